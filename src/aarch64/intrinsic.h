@@ -92,6 +92,15 @@ static ALWAYS_INLINE u64 arch_get_elr() {
     return result;
 }
 
+// read Fault Address Register (EL1).
+static ALWAYS_INLINE u64 arch_get_far() {
+    u64 result;
+    arch_fence();
+    asm volatile("mrs %[x], far_el1" : [x] "=r"(result));
+    arch_fence();
+    return result;
+}
+
 // set vector base (virtual) address register (EL1).
 static ALWAYS_INLINE void arch_set_vbar(void *ptr) {
     arch_fence();
@@ -99,6 +108,12 @@ static ALWAYS_INLINE void arch_set_vbar(void *ptr) {
     arch_fence();
 }
 
+// set architectural feature access control register (EL1).
+static ALWAYS_INLINE void arch_set_cpacr(u64 value) {
+    asm volatile("msr cpacr_el1, %[x]" : : [x] "r"(value));
+    arch_fence();
+}
+
 // flush TLB entries.
 static ALWAYS_INLINE void arch_tlbi_vmalle1is() {
     arch_fence();
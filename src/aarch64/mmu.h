@@ -29,6 +29,13 @@
 
 #define PTE_KERNEL (0 << 6)
 #define PTE_USER   (1 << 6)
+#define PTE_RO     (1 << 7)
+#define PTE_PXN    (1ull << 53)
+#define PTE_UXN    (1ull << 54)
+
+// software-defined bit: the page is shared by all mappers of a file page and
+// is not owned by the page table, so it is neither copied nor freed with it.
+#define PTE_FILE (1ull << 55)
 
 #define PTE_KERNEL_DATA   (PTE_KERNEL | PTE_NORMAL | PTE_BLOCK)
 #define PTE_KERNEL_DEVICE (PTE_KERNEL | PTE_DEVICE | PTE_BLOCK)
@@ -54,5 +61,5 @@ typedef u64 PTEntry;
 typedef PTEntry PTEntries[N_PTE_PER_TABLE];
 typedef PTEntry *PTEntriesPtr;
 
-#define PTE_ADDRESS(pte) ((pte) & (~0xFFFu))
-#define PTE_FLAGS(pte)   ((pte) & (0xFFFu))
+#define PTE_ADDRESS(pte) ((pte) & 0x0000FFFFFFFFF000)
+#define PTE_FLAGS(pte)   ((pte) & 0xFFF0000000000FFFull)
@@ -4,25 +4,16 @@
 #include <core/physical_memory.h>
 #include <core/sched.h>
 #include <core/virtual_memory.h>
+#include <fs/inode.h>
 
 struct container *root_container = 0;
 static Arena arena;
-bool do_cont_test = false;
-
+static struct container *containers[NCONTAINER]; /* By id */
+static int nr_containers;
 extern void add_loop_test(int times);
 
-static NO_RETURN void container_entry() {
-    release_sched_lock();
-    thiscpu()->scheduler = &((struct container *)(thiscpu()->proc->cont))->scheduler;
-    if (do_cont_test) {
-        do_cont_test = false;
-        add_loop_test(8);
-    }
-
-    enter_scheduler();
-    PANIC("scheduler should not return");
-}
-struct container *alloc_container(bool root) {
+/* Allocate a container nested in parent, or the root one if parent is 0. */
+struct container *alloc_container(struct container *parent) {
     struct container *c = 0;
     struct proc *p;
 
@@ -31,8 +22,19 @@ struct container *alloc_container(bool root) {
         goto ret;
     }
     memset(c, 0, sizeof(*c));
-    c->scheduler.pid = 0;
-    if (root) {
+    c->id = __atomic_add_fetch(&nr_containers, 1, __ATOMIC_RELAXED);
+    if (c->id >= NCONTAINER) {
+        free_object(c);
+        c = 0;
+        goto ret;
+    }
+    init_container_cpu(c);
+    if (init_pid_namespace(&c->pid_ns, parent ? &parent->pid_ns : 0) < 0) {
+        free_object(c);
+        c = 0;
+        goto ret;
+    }
+    if (parent == 0) {
         goto ret;
     }
     p = alloc_pcb();
@@ -40,77 +42,170 @@ struct container *alloc_container(bool root) {
         goto ret;
     }
 
-    p->pgdir = pgdir_init();
-
-    // kstack
-    // char *sp = kalloc();
-    // if (sp == NULL) {
-    //     PANIC("cont_alloc: cannot alloc kstack");
-    // }
-    // p->kstack = sp;
-    // sp += KSTACKSIZE;
-
-    // sp -= sizeof(*(p->context));
-    for (int i = 0; i < NCPU; i++) {
-        char *sp = kalloc();
-        if (sp == NULL) {
-            PANIC("cont_alloc: cannot alloc kstack");
-        }
-        sp += KSTACKSIZE;
-
-        sp -= sizeof(*(p->context));
-        c->scheduler.context[i] = (struct context *)sp;
-        memset(c->scheduler.context[i], 0, sizeof(*c->scheduler.context[i]));
-        c->scheduler.context[i]->lr0 = (u64)container_entry;
-    }
-    // p->context = (struct context *)sp;
-    // memset(p->context, 0, sizeof(*(p->context)));
-    // p->context->lr0 = container_entry;
+    /* Never switched to, see _run in sched.c, but has an mm like any process. */
+    p->mm = mm_alloc();
     c->p = p;
     p->cont = c;
     p->is_scheduler = true;
-    p->state = RUNNABLE;
 ret:
+    if (c != 0)
+        __atomic_store_n(&containers[c->id], c, __ATOMIC_RELEASE);
     return c;
 }
 
+/* The container of the current process, or 0 before there is any. */
+struct container *current_container() {
+    struct proc *p = thiscpu()->proc;
+    if (root_container == 0)
+        return 0;
+    if (p == 0 || p->scheduler == 0)
+        return root_container;
+    return p->scheduler->cont;
+}
+
+/* The container with this id, or 0 if none. */
+struct container *get_container(int id) {
+    if (id <= 0 || id >= NCONTAINER)
+        return 0;
+    return __atomic_load_n(&containers[id], __ATOMIC_ACQUIRE);
+}
+
+/* Exact usage, counting the pages not folded in yet. */
+static i64 _mem_usage(struct mem_counter *mem) {
+    i64 usage = __atomic_load_n(&mem->usage, __ATOMIC_RELAXED);
+    for (int i = 0; i < NCPU; i++)
+        usage += __atomic_load_n(&mem->local[i].count, __ATOMIC_RELAXED);
+    return usage;
+}
+
+/*
+ * Charge delta pages on this CPU, folding them into the shared count once
+ * a batch has built up. The kernel is not preemptible, so nothing else
+ * touches the count of this CPU but readers.
+ */
+static void _mem_add(struct mem_counter *mem, i64 delta) {
+    i64 *count = &mem->local[cpuid()].count;
+    i64 n = *count + delta;
+    if (n >= MEM_CHARGE_BATCH || n <= -MEM_CHARGE_BATCH) {
+        i64 usage = __atomic_add_fetch(&mem->usage, n, __ATOMIC_RELAXED);
+        u64 max = __atomic_load_n(&mem->max_usage, __ATOMIC_RELAXED);
+        while (usage > 0 && (u64)usage > max &&
+               !__atomic_compare_exchange_n(&mem->max_usage, &max, (u64)usage, false,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+        n = 0;
+    }
+    __atomic_store_n(count, n, __ATOMIC_RELAXED);
+}
+
+/* Whether the owner of page is c or one of its descendants. */
+static bool _charged_to(void *page, void *arg) {
+    struct container *c = get_container(page_owner(page));
+    for (; c != 0; c = c->parent) {
+        if (c == arg)
+            return true;
+        if (c == root_container)
+            break;
+    }
+    return false;
+}
+
+/*
+ * Drop cached pages charged to c, or below it, until it is back under its
+ * limit. Only unmapped pages of the page cache are taken, which are clean
+ * copies of the disk. Returns whether there is room for one more page.
+ */
+static bool _mem_reclaim(struct container *c) {
+    u64 limit = c->mem.limit;
+    while (_mem_usage(&c->mem) >= (i64)limit) {
+        usize n = inodes.shrink(_charged_to, c, MEM_CHARGE_BATCH);
+        if (n == 0)
+            return false;
+        __atomic_add_fetch(&c->mem.reclaimed, n, __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+/*
+ * Charge a page to c and each container above it. Only a container close
+ * to its limit is counted exactly. Returns 0, or -1 if some limit is hit
+ * even after reclaiming, in which case nothing is charged.
+ */
+int mem_charge(struct container *c) {
+    struct container *top = c;
+    for (; top != 0; top = top->parent) {
+        struct mem_counter *mem = &top->mem;
+        i64 limit = (i64)__atomic_load_n(&mem->limit, __ATOMIC_RELAXED);
+        i64 usage = __atomic_load_n(&mem->usage, __ATOMIC_RELAXED);
+        if (limit != 0 && usage + NCPU * MEM_CHARGE_BATCH >= limit && !_mem_reclaim(top)) {
+            __atomic_add_fetch(&mem->failcnt, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        _mem_add(mem, 1);
+        if (top == root_container) {
+            top = 0;
+            break;
+        }
+    }
+    if (top == 0)
+        return 0;
+    /* Undo the charges below the one that failed. */
+    for (; c != top; c = c->parent)
+        _mem_add(&c->mem, -1);
+    return -1;
+}
+
+/* Uncharge a page from c and each container above it. */
+void mem_uncharge(struct container *c) {
+    for (; c != 0; c = c->parent) {
+        _mem_add(&c->mem, -1);
+        if (c == root_container)
+            break;
+    }
+}
+
+/* Set the limit of c, rounded up to pages, or none if bytes is 0. */
+int set_container_mem_limit(struct container *c, u64 bytes) {
+    if (c == root_container)
+        return -1;
+    __atomic_store_n(&c->mem.limit, round_up(bytes, PAGE_SIZE) / PAGE_SIZE, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void get_container_mem_stat(struct container *c, struct mem_stat *st) {
+    i64 usage = _mem_usage(&c->mem);
+    st->usage = usage > 0 ? (u64)usage * PAGE_SIZE : 0;
+    st->max_usage = __atomic_load_n(&c->mem.max_usage, __ATOMIC_RELAXED) * PAGE_SIZE;
+    st->limit = __atomic_load_n(&c->mem.limit, __ATOMIC_RELAXED) * PAGE_SIZE;
+    st->failcnt = __atomic_load_n(&c->mem.failcnt, __ATOMIC_RELAXED);
+    st->reclaimed = __atomic_load_n(&c->mem.reclaimed, __ATOMIC_RELAXED) * PAGE_SIZE;
+}
+
 void init_container() {
     ArenaPageAllocator allocator = {.allocate = kalloc, .free = kfree};
 
     init_arena(&arena, sizeof(struct container), allocator);
 
-    root_container = alloc_container(true);
+    root_container = alloc_container(0);
+    if (root_container == 0)
+        PANIC("init_container: cannot alloc root container");
 
     root_container->parent = root_container;
     init_spinlock(&root_container->lock, "root container");
-    init_spinlock(&root_container->scheduler.ptable.lock, "root scheduler");
     root_container->p = 0;
-    root_container->scheduler.op = &simple_op;
+    root_container->scheduler.op = &rt_op;
+    root_container->scheduler.op->init(&root_container->scheduler);
     root_container->scheduler.cont = root_container;
 }
 
+/* Returns (void *)-1 if the resource can not be had. */
 void *alloc_resource(struct container *this, struct proc *p, resource_t resource) {
-    int pid;
-    acquire_spinlock(&this->lock);
     switch (resource) {
-        case MEMORY: break;
-        case PID:
-            if (this->scheduler.pid == NPID) {
-                return (void *)-1;
-            }
-            pid = ++this->scheduler.pid;
-            this->pmap[pid].valid = true;
-            this->pmap[pid].p = p;
-            this->pmap[pid].pid_local = pid;
-            break;
+        case MEMORY: break; /* Charged page by page, see mem_charge */
+        case PID: return alloc_pid(&this->pid_ns, p) < 0 ? (void *)-1 : 0;
         case INODE: break;
         default:;
     }
-    release_spinlock(&this->lock);
-
-    if (this != root_container) {
-        alloc_resource(this->parent, p, resource);
-    }
     return 0;
 }
 
@@ -118,7 +213,7 @@ struct container *spawn_container(struct container *this, struct sched_op *op) {
     if (this == 0) {
         return 0;
     }
-    struct container *c = alloc_container(false);
+    struct container *c = alloc_container(this);
     if (c == 0) {
         goto ret;
     }
@@ -127,7 +222,10 @@ struct container *spawn_container(struct container *this, struct sched_op *op) {
     c->scheduler.parent = &this->scheduler;
     c->parent = this;
     init_spinlock(&c->lock, "cont lock");
-    init_spinlock(&c->scheduler.ptable.lock, "p1 lock");
+    op->init(&c->scheduler);
+    /* Only now may a CPU enter the new scheduler. */
+    if (c->p != 0)
+        activate(c->p);
 
 ret:
     return c;
@@ -138,9 +236,13 @@ ret:
  */
 void container_test_init() {
     struct container *c;
+    struct scheduler *s = thiscpu()->scheduler;
 
-    do_cont_test = true;
     add_loop_test(1);
     c = spawn_container(root_container, &simple_op);
     assert(c != NULL);
+    /* The processes of a container are allocated by its scheduler. */
+    thiscpu()->scheduler = &c->scheduler;
+    add_loop_test(8);
+    thiscpu()->scheduler = s;
 }
@@ -1,27 +1,88 @@
 #pragma once
 
 #include <common/spinlock.h>
+#include <core/pid.h>
 #include <core/proc.h>
 #include <core/sched.h>
+#include <core/timer.h>
 
-#define NPID 64
-struct pid_mapping {
-    bool valid;
-    int pid_local;
-    struct proc *p;
+typedef enum { MEMORY, PID, INODE } resource_t;
+
+/*
+ * CPU controller of a container, like cpu.shares and cpu.cfs_quota_us of
+ * cgroups. The process p of the container competes in the scheduler of
+ * the parent with shares as its weight, and is not RUNNABLE once it has
+ * run quota in the current period, until the period is over. Times are
+ * in ticks of the generic timer. Guarded by the lock of the container.
+ */
+#define CPU_SHARES_DEFAULT    1024 /* As much as a process of nice 0 */
+#define CPU_SHARES_MIN        2
+#define CPU_SHARES_MAX        262144
+#define CPU_PERIOD_MIN_US     1000
+#define CPU_PERIOD_MAX_US     1000000
+#define CPU_PERIOD_DEFAULT_US 100000
+
+struct cpu_bandwidth {
+    u64 shares;       /* Weight against the other processes of the parent */
+    u64 quota;        /* Run time allowed per period, 0 if unlimited */
+    u64 period;
+    u64 period_start; /* Timestamp when the current period began */
+    u64 period_used;  /* Run time in the current period */
+    bool throttled;   /* Out of quota until the period is over */
+    u64 throttled_at; /* Timestamp when last throttled */
+    Timer unthrottle; /* Fires at the end of a throttled period */
+
+    /* Statistics. */
+    u64 usage;          /* Run time, that of nested containers included */
+    u64 nr_periods;     /* Periods it ran in with a quota */
+    u64 nr_throttled;   /* Periods it ran out of quota in */
+    u64 throttled_time; /* Time spent throttled */
 };
-typedef struct pid_mapping pid_mapping;
 
-typedef enum { MEMORY, PID, INODE } resource_t;
+/*
+ * Memory controller of a container, like memory.limit_in_bytes of cgroups.
+ * Every page kalloc_charged hands out, user memory and cached file data,
+ * is charged to the container of the current process and to those above
+ * it, and uncharged when freed. Kernel metadata is never charged. Usage is
+ * counted per CPU and folded into the shared count MEM_CHARGE_BATCH pages
+ * at a time, so charging takes no lock. Near its limit, a container
+ * counts exactly, and reclaims pages it cached before failing a charge.
+ * Counts are in pages.
+ */
+#define NCONTAINER       1024 /* ids of containers, 0 meaning none */
+#define MEM_CHARGE_BATCH 32
+
+struct mem_counter {
+    i64 usage;     /* Pages charged, but those not folded in yet */
+    u64 limit;     /* 0 if unlimited */
+    u64 max_usage;
+    u64 failcnt;   /* Charges refused */
+    u64 reclaimed; /* Pages reclaimed to stay under the limit */
+    /* Charged on each CPU and not folded in yet, a cache line each. */
+    struct {
+        i64 count;
+    } __attribute__((aligned(64))) local[NCPU];
+};
+
+/* Memory use of a container, in bytes, as read by mymemstat. */
+struct mem_stat {
+    u64 usage;
+    u64 max_usage; /* Highest usage seen, up to a batch per CPU */
+    u64 limit;     /* 0 if unlimited */
+    u64 failcnt;
+    u64 reclaimed;
+};
 
 struct container {
     struct proc *p;
     struct scheduler scheduler;
     SpinLock lock;
     struct container *parent;
-
-    // pid
-    struct pid_mapping pmap[NPID];
+    int id; /* Marks the pages charged to it, see kalloc_charged */
+    struct cpu_bandwidth cpu;
+    bool woken; /* Something was woken while p was RUNNING, see _run */
+    struct mem_counter mem;
+    struct pid_namespace pid_ns; /* Of the processes of scheduler */
 };
 
 typedef struct container container;
@@ -32,6 +93,13 @@ void init_container();
 
 void *alloc_resource(struct container *this, struct proc *p, resource_t resource);
 
+struct container *current_container();
+struct container *get_container(int id);
+int mem_charge(struct container *c);
+void mem_uncharge(struct container *c);
+int set_container_mem_limit(struct container *c, u64 bytes);
+void get_container_mem_stat(struct container *c, struct mem_stat *st);
+
 void trace_usage(struct container *this, struct proc *p, resource_t resource);
 
 void container_test_init();
@@ -1,8 +1,11 @@
 #include <elf.h>
+#include <sys/mman.h>
 
 #include <aarch64/mmu.h>
 #include <common/string.h>
 #include <core/console.h>
+#include <core/fpsimd.h>
+#include <core/physical_memory.h>
 #include <core/proc.h>
 #include <core/sched.h>
 #include <core/syscall.h>
@@ -13,22 +16,81 @@
 
 static uint64_t auxv[][2] = {{AT_PAGESZ, PAGE_SIZE}};
 
-int execve(const char *path, char *const argv[], char *const envp[]) {
-    char *s;
-    if (fetchstr((uint64_t)path, &s) < 0)
-        return -1;
+/*
+ * A read-only segment can be mapped from the page cache instead of
+ * copied, if it is page-aligned in the file and shares no page with
+ * another segment, which would have to be written into it.
+ */
+static bool mappable(Inode *ip, Elf64_Ehdr *elf, Elf64_Phdr *ph, int index) {
+    if ((ph->p_flags & PF_W) || ph->p_filesz != ph->p_memsz ||
+        ph->p_vaddr % PAGE_SIZE != ph->p_offset % PAGE_SIZE)
+        return false;
+
+    u64 start = round_down(ph->p_vaddr, PAGE_SIZE);
+    u64 end = round_up(ph->p_vaddr + ph->p_memsz, PAGE_SIZE);
+    Elf64_Phdr other;
+    uint64_t off = elf->e_phoff;
+    for (int i = 0; i < elf->e_phnum; i++, off += sizeof(other)) {
+        inodes.read(ip, (u8 *)&other, off, sizeof(other));
+        if (i == index || other.p_type != PT_LOAD)
+            continue;
+        if (round_down(other.p_vaddr, PAGE_SIZE) < end &&
+            start < round_up(other.p_vaddr + other.p_memsz, PAGE_SIZE))
+            return false;
+    }
+    return true;
+}
 
-    // Save previous page table.
+/* Open ip read-only for the regions mapping its segments. */
+static struct file *open_text(Inode *ip) {
+    struct file *f = filealloc();
+    if (f == 0)
+        return 0;
+    f->type = FD_INODE;
+    f->ip = inodes.share(ip);
+    f->readable = 1;
+    f->writable = 0;
+    f->off = 0;
+    return f;
+}
+
+/*
+ * Push the strings of the user array vec onto the stack of pgdir below
+ * *sp, through the page buf, up to a null or inaccessible entry.
+ * Returns how many, or -1 if a string is inaccessible or too long.
+ */
+static int push_strings(void *pgdir, char **sp, char *const vec[], char *buf) {
+    int n = 0;
+    u64 s;
+    isize len;
+    for (; copy_from_user(&s, (u64)(vec + n), sizeof(s)) == 0 && s; n++) {
+        if ((len = (isize)fetchstr(s, buf, PAGE_SIZE)) < 0)
+            return -1;
+        *sp -= len + 1;
+        if (copyout(pgdir, *sp, buf, (usize)(len + 1)) < 0)  // include '\0';
+            return -1;
+    }
+    return n;
+}
+
+/* path is in the kernel, argv and envp are in the current process. */
+int execve(const char *path, char *const argv[], char *const envp[]) {
+    // Save previous address space, which other threads may share.
     struct proc *curproc = thiscpu()->proc;
-    void *oldpgdir = curproc->pgdir, *pgdir = pgdir_init();
+    struct mm *oldmm = curproc->mm, *mm = mm_alloc();
+    void *pgdir = mm ? mm->pgdir : 0;
     Inode *ip = 0;
+    MmapRegion text[NMMAP] = {0};
+    struct file *text_file = 0;
+    char *strbuf = 0;
+    int ntext = 0;
 
-    if (pgdir == 0) {
+    if (mm == 0) {
         // debug("vm init failed");
         goto bad;
     }
 
-    // trace("path='%s', argv=0x%p, envp=0x%p", s, argv, envp);
+    // trace("path='%s', argv=0x%p, envp=0x%p", path, argv, envp);
 
     OpContext ctx;
     bcache.begin_op(&ctx);
@@ -57,8 +119,8 @@ int execve(const char *path, char *const argv[], char *const envp[]) {
     uint64_t off;
     Elf64_Phdr ph;
 
-    curproc->pgdir =
-        pgdir;  // Required since inodes.read(sdrw) involves context switch(switch page table).
+    curproc->mm =
+        mm;  // Required since inodes.read(sdrw) involves context switch(switch page table).
 
     // Load program into memory.
     usize sz = 0, base = 0, stksz = 0;
@@ -90,6 +152,21 @@ int execve(const char *path, char *const argv[], char *const envp[]) {
             }
         }
 
+        // Map read-only segments from the page cache on demand.
+        if (ntext < NMMAP && ip->entry.type == INODE_REGULAR && mappable(ip, &elf, &ph, i)) {
+            if (text_file == 0 && (text_file = open_text(ip)) == 0)
+                goto bad;
+            MmapRegion *r = &text[ntext++];
+            r->start = round_down(ph.p_vaddr, PAGE_SIZE);
+            r->end = round_up(ph.p_vaddr + ph.p_memsz, PAGE_SIZE);
+            r->prot = PROT_READ | ((ph.p_flags & PF_X) ? PROT_EXEC : 0);
+            r->flags = MAP_PRIVATE;
+            r->file = filedup(text_file);
+            r->offset = round_down(ph.p_offset, PAGE_SIZE);
+            sz = MAX(sz, ph.p_vaddr + ph.p_memsz);
+            continue;
+        }
+
         if ((sz = (usize)uvm_alloc(pgdir, base, stksz, sz, ph.p_vaddr + ph.p_memsz)) == 0) {
             // debug("uvm_alloc bad");
             goto bad;
@@ -113,34 +190,23 @@ int execve(const char *path, char *const argv[], char *const envp[]) {
     ip = 0;
 
     // Push argument strings, prepare rest of stack in ustack.
-    uvm_switch(oldpgdir);
+    // Arguments in mmap regions are faulted into the old image.
+    uvm_switch(oldmm->pgdir);
+    curproc->mm = oldmm;
     char *sp = (char *)USPACE_TOP;
     int argc = 0, envc = 0;
-    isize len;
-    if (argv) {
-        for (; in_user((void *)(argv + argc), sizeof(*argv)) && argv[argc]; argc++) {
-            if ((len = (isize)fetchstr((uint64_t)argv[argc], &s)) < 0) {
-                // debug("argv fetchstr bad");
-                goto bad;
-            }
-            // trace("argv[%d] = '%s', len: %d", argc, argv[argc], len);
-            sp -= len + 1;
-            if (copyout(pgdir, sp, argv[argc], (usize)(len + 1)) < 0)  // include '\0';
-                goto bad;
-        }
+    if ((strbuf = kalloc()) == 0)
+        goto bad;
+    if (argv && (argc = push_strings(pgdir, &sp, argv, strbuf)) < 0) {
+        // debug("argv fetchstr bad");
+        goto bad;
     }
-    if (envp) {
-        for (; in_user((void *)(envp + envc), sizeof(*envp)) && envp[envc]; envc++) {
-            if ((len = (isize)fetchstr((uint64_t)envp[envc], &s)) < 0) {
-                // debug("envp fetchstr bad");
-                goto bad;
-            }
-            // trace("envp[%d] = '%s', len: %d", envc, envp[envc], len);
-            sp -= len + 1;
-            if (copyout(pgdir, sp, envp[envc], (usize)(len + 1)) < 0)  // include '\0';
-                goto bad;
-        }
+    if (envp && (envc = push_strings(pgdir, &sp, envp, strbuf)) < 0) {
+        // debug("envp fetchstr bad");
+        goto bad;
     }
+    kfree(strbuf);
+    strbuf = 0;
     // Align to 16B. 3 zero terminator of auxv/envp/argv and 1 argc.
     void *newsp = (void *)round_down((usize)sp - sizeof(auxv) - (usize)(envc + argc + 4) * 8, 16);
     if (copyout(pgdir, newsp, 0, (usize)sp - (usize)newsp) < 0)
@@ -177,20 +243,22 @@ int execve(const char *path, char *const argv[], char *const envp[]) {
     assert((uint64_t)sp > USPACE_TOP - stksz);
 
     // Commit to the user image.
-    curproc->pgdir = pgdir;
-
-    curproc->base = base;
-    curproc->sz = sz;
-    curproc->stksz = stksz;
+    mm->base = base;
+    mm->sz = sz;
+    mm->stksz = stksz;
+    memmove(mm->mmaps, text, sizeof(text));
+    curproc->mm = mm;
 
     // memset(curproc->tf, 0, sizeof(*curproc->tf));
 
     curproc->tf->elr = elf.e_entry;
     curproc->tf->sp = (uint64_t)sp;
 
-    // trace("entry 0x%p", elf.e_entry);
+    // the new image starts with zeroed FP/SIMD registers.
+    fpsimd_release(curproc);
+    fpsimd_free(curproc);
 
-    uvm_switch(oldpgdir);
+    // trace("entry 0x%p", elf.e_entry);
 
     // Save program name for debugging.
     const char *last, *cur;
@@ -198,17 +266,31 @@ int execve(const char *path, char *const argv[], char *const envp[]) {
         if (*cur == '/')
             last = cur + 1;
     memmove(curproc->name, last, sizeof(curproc->name));
-    uvm_switch(curproc->pgdir);
-    // vm_free(oldpgdir);
+    if (text_file)
+        fileclose(text_file);
+    uvm_switch(mm->pgdir);
+
+    // The other threads ran the old image, which is dropped with the last of them.
+    kill_other_threads();
+    mm_release(oldmm);
+    mm_put(oldmm);
     // trace("finish %s", curproc->name);
     return 0;
 
 bad:
-    if (pgdir)
-        vm_free(pgdir);
+    // Leave the new page table before freeing it.
+    thiscpu()->proc->mm = oldmm;
+    uvm_switch(oldmm->pgdir);
+    if (mm)
+        mm_release(mm), mm_put(mm);
     if (ip)
         inodes.unlock(ip), inodes.put(&ctx, ip), bcache.end_op(&ctx);
-    thiscpu()->proc->pgdir = oldpgdir;
+    for (int i = 0; i < ntext; i++)
+        fileclose(text[i].file);
+    if (text_file)
+        fileclose(text_file);
+    if (strbuf)
+        kfree(strbuf);
     // debug("bad");
     return -1;
 }
@@ -0,0 +1,118 @@
+#include <aarch64/intrinsic.h>
+#include <common/string.h>
+#include <core/arena.h>
+#include <core/console.h>
+#include <core/fpsimd.h>
+#include <core/physical_memory.h>
+#include <core/proc.h>
+#include <core/sched.h>
+
+/*
+ * FP/SIMD registers are switched lazily. The kernel is built with
+ * -mgeneral-regs-only, so they only ever hold user state: that of the
+ * owner of the CPU, which is the last process to use them there.
+ *
+ * A process switched in finds FP/SIMD enabled only if it owns the CPU and
+ * has not run elsewhere since, that is, if the registers still hold its
+ * state. Otherwise its first access traps, saves the registers of the
+ * owner if it may have changed them, and loads its own saved state. So a
+ * process that has a CPU to itself, or shares it with ones that don't use
+ * FP/SIMD, neither saves nor restores them.
+ *
+ * A process whose registers are not saved yet (fpsimd_dirty) can't move to
+ * another CPU, which would not see them. There is at most one on each CPU,
+ * its owner, and it is saved before it is pushed away, see _push.
+ */
+#define CPACR_FPEN_TRAP_EL0 (1 << 20) /* EL0 accesses trap, EL1 ones don't */
+#define CPACR_FPEN_NO_TRAP  (3 << 20)
+
+void fpsimd_save(FpsimdState *state);
+void fpsimd_load(FpsimdState *state);
+
+static Arena fpsimd_arena;
+
+void init_fpsimd() {
+    ArenaPageAllocator allocator = {.allocate = kalloc, .free = kfree};
+    init_arena(&fpsimd_arena, sizeof(FpsimdState), allocator);
+}
+
+/*
+ * Save the registers of p if they are live on this CPU and newer. Another
+ * CPU that sees p clean may run it, and load what was saved.
+ */
+void fpsimd_flush(struct proc *p) {
+    if (p->fpsimd_dirty && p->fpsimd_cpu == (int)cpuid()) {
+        fpsimd_save(p->fpsimd);
+        __atomic_store_n(&p->fpsimd_dirty, false, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Called by the scheduler, with its lock held, before switching to p.
+ * The registers of another owner are left alone until p traps.
+ */
+void fpsimd_switch_in(struct proc *p) {
+    if (thiscpu()->fpsimd_owner == p && p->fpsimd_cpu == (int)cpuid()) {
+        arch_set_cpacr(CPACR_FPEN_NO_TRAP);
+        /* It may change them from now on. */
+        p->fpsimd_dirty = true;
+        return;
+    }
+    arch_set_cpacr(CPACR_FPEN_TRAP_EL0);
+}
+
+/* The current process accessed FP/SIMD registers that don't hold its state. */
+void fpsimd_trap() {
+    struct proc *p = thiscpu()->proc, *owner = thiscpu()->fpsimd_owner;
+    if (p->fpsimd == NULL) {
+        p->fpsimd = alloc_object(&fpsimd_arena);
+        if (p->fpsimd == NULL) {
+            printf("pid %d %s: cannot alloc FP/SIMD state\n", p->pid, p->name);
+            exit(KILL_STATUS(SIGKILL));
+        }
+        memset(p->fpsimd, 0, sizeof(FpsimdState));
+    }
+    /* The registers are needed now, so the owner can't keep them any longer. */
+    if (owner != NULL && owner != p)
+        fpsimd_flush(owner);
+    fpsimd_load(p->fpsimd);
+    thiscpu()->fpsimd_owner = p;
+    p->fpsimd_cpu = (int)cpuid();
+    p->fpsimd_dirty = true;
+    arch_set_cpacr(CPACR_FPEN_NO_TRAP);
+}
+
+/* The child of a fork starts with a copy of the registers of its parent. */
+int fpsimd_fork(struct proc *child, struct proc *parent) {
+    if (parent->fpsimd == NULL)
+        return 0;
+    child->fpsimd = alloc_object(&fpsimd_arena);
+    if (child->fpsimd == NULL)
+        return -1;
+    fpsimd_flush(parent);
+    memcpy(child->fpsimd, parent->fpsimd, sizeof(FpsimdState));
+    return 0;
+}
+
+/*
+ * Make sure no CPU has p as its owner, before p exits or execs. The
+ * current process traps on its next access then.
+ */
+void fpsimd_release(struct proc *p) {
+    for (int i = 0; i < NCPU; i++) {
+        struct proc *owner = p;
+        __atomic_compare_exchange_n(&cpus[i].fpsimd_owner, &owner, NULL, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+    p->fpsimd_cpu = -1;
+    p->fpsimd_dirty = false;
+    if (p == thiscpu()->proc)
+        arch_set_cpacr(CPACR_FPEN_TRAP_EL0);
+}
+
+/* Free the saved state of p, which must own no CPU. */
+void fpsimd_free(struct proc *p) {
+    if (p->fpsimd != NULL)
+        free_object(p->fpsimd);
+    p->fpsimd = NULL;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <common/defines.h>
+
+struct proc;
+
+/* FP/SIMD registers of a process, as fpsimd_save/fpsimd_load lay them out. */
+typedef struct {
+    u64 q[32][2]; /* V0 ... V31 */
+    u32 fpsr, fpcr;
+    u64 padding;
+} FpsimdState;
+
+void init_fpsimd();
+void fpsimd_switch_in(struct proc *p);
+void fpsimd_trap();
+void fpsimd_flush(struct proc *p);
+int fpsimd_fork(struct proc *child, struct proc *parent);
+void fpsimd_release(struct proc *p);
+void fpsimd_free(struct proc *p);
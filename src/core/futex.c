@@ -0,0 +1,204 @@
+#include <common/list.h>
+#include <common/spinlock.h>
+#include <core/futex.h>
+#include <core/proc.h>
+#include <core/sched.h>
+#include <core/syscall.h>
+#include <core/timer.h>
+#include <core/virtual_memory.h>
+
+/*
+ * A futex is a 32-bit word of user memory. Its waiters are queued on a
+ * bucket hashed by the physical address of the word, so threads sharing
+ * an address space and processes sharing a mapped file find each other
+ * alike. The word is compared under the bucket lock, and a waker changes
+ * it before taking that lock, so no wakeup is lost. It is read at its
+ * physical address through the kernel mapping, which stays valid even if
+ * another thread unmaps the page meanwhile.
+ *
+ * A waiter is guarded by the lock of the bucket it is on. futex_requeue
+ * may move it to another bucket meanwhile, so it is locked by retrying
+ * until the bucket doesn't change, see _lock_waiter.
+ */
+#define NFUTEX 64
+
+typedef struct {
+    SpinLock lock;
+    ListNode head;
+} FutexBucket;
+
+typedef struct {
+    ListNode node;       /* Link in the bucket */
+    u64 key;             /* Physical address of the word */
+    FutexBucket *bucket; /* Bucket it is on */
+    bool woken, timed_out;
+    Timer timer;
+} FutexWaiter;
+
+static FutexBucket buckets[NFUTEX];
+
+void init_futex() {
+    for (int i = 0; i < NFUTEX; i++) {
+        init_spinlock(&buckets[i].lock, "futex");
+        init_list_node(&buckets[i].head);
+    }
+}
+
+static INLINE FutexBucket *_bucket(u64 key) {
+    return &buckets[((key * 0x9e3779b97f4a7c15ull) >> 58) % NFUTEX];
+}
+
+/*
+ * The physical address of the futex word at uaddr in the current process,
+ * or 0 if it is not an aligned, writable word. Copy-on-write pages are
+ * written first, so the word stays at that address.
+ */
+static u64 _key(u32 *uaddr) {
+    if ((u64)uaddr % sizeof(u32) != 0)
+        return 0;
+    return uvm_phys(thiscpu()->proc, (u64)uaddr, true);
+}
+
+/* The current value of the futex word at key. */
+static INLINE u32 _value(u64 key) {
+    return *(volatile u32 *)P2K(key);
+}
+
+static FutexBucket *_lock_waiter(FutexWaiter *w) {
+    for (;;) {
+        FutexBucket *b = w->bucket;
+        acquire_spinlock(&b->lock);
+        if (b == w->bucket)
+            return b;
+        release_spinlock(&b->lock);
+    }
+}
+
+static void _lock_two(FutexBucket *b1, FutexBucket *b2) {
+    if (b1 > b2) {
+        FutexBucket *t = b1;
+        b1 = b2;
+        b2 = t;
+    }
+    acquire_spinlock(&b1->lock);
+    if (b1 != b2)
+        acquire_spinlock(&b2->lock);
+}
+
+static void _unlock_two(FutexBucket *b1, FutexBucket *b2) {
+    if (b1 != b2)
+        release_spinlock(&b2->lock);
+    release_spinlock(&b1->lock);
+}
+
+/* Take w off its bucket and wake it. Must hold the bucket lock. */
+static void _wake_waiter(FutexWaiter *w) {
+    detach_from_list(&w->node);
+    w->woken = true;
+    wakeup(w);
+}
+
+static void _timeout(Timer *timer) {
+    FutexWaiter *w = container_of(timer, FutexWaiter, timer);
+    FutexBucket *b = _lock_waiter(w);
+    w->timed_out = true;
+    wakeup(w);
+    release_spinlock(&b->lock);
+}
+
+/*
+ * Sleep on the futex at uaddr if it holds val, until woken by futex_wake
+ * or, unless expires is 0, until that timestamp. Returns 0 if woken, or -1
+ * if the word didn't hold val, the time ran out or the process was killed.
+ */
+int futex_wait(u32 *uaddr, u32 val, u64 expires) {
+    struct proc *p = thiscpu()->proc;
+    FutexWaiter w;
+    if ((w.key = _key(uaddr)) == 0)
+        return -1;
+    init_list_node(&w.node);
+    w.bucket = _bucket(w.key);
+    w.woken = false;
+    w.timed_out = false;
+    init_timer(&w.timer, _timeout);
+
+    FutexBucket *b = w.bucket;
+    acquire_spinlock(&b->lock);
+    if (_value(w.key) != val) {
+        release_spinlock(&b->lock);
+        return -1;
+    }
+    merge_list(b->head.prev, &w.node);
+    if (expires != 0 && timer_add(&w.timer, expires) < 0)
+        w.timed_out = true;
+
+    while (!w.woken && !w.timed_out && !p->killed) {
+        sleep(&w, &b->lock);
+        if (b != w.bucket) {
+            release_spinlock(&b->lock);
+            b = _lock_waiter(&w);
+        }
+    }
+    if (!w.woken)
+        detach_from_list(&w.node);
+    release_spinlock(&b->lock);
+    timer_cancel(&w.timer);
+    return w.woken ? 0 : -1;
+}
+
+/* Wake at most n waiters of the futex at uaddr. Returns how many, or -1. */
+int futex_wake(u32 *uaddr, int n) {
+    u64 key = _key(uaddr);
+    if (key == 0 || n < 0)
+        return -1;
+
+    FutexBucket *b = _bucket(key);
+    int woken = 0;
+    acquire_spinlock(&b->lock);
+    for (ListNode *node = b->head.next; node != &b->head && woken < n;) {
+        FutexWaiter *w = container_of(node, FutexWaiter, node);
+        node = node->next;
+        if (w->key == key) {
+            _wake_waiter(w);
+            woken++;
+        }
+    }
+    release_spinlock(&b->lock);
+    return woken;
+}
+
+/*
+ * Wake at most nwake waiters of the futex at uaddr, and move at most
+ * nrequeue of the others to wait on uaddr2 instead. With cmp, do nothing
+ * unless uaddr holds val. Returns how many were woken or moved, or -1.
+ */
+int futex_requeue(u32 *uaddr, int nwake, int nrequeue, u32 *uaddr2, bool cmp, u32 val) {
+    u64 key = _key(uaddr), key2 = _key(uaddr2);
+    if (key == 0 || key2 == 0 || nwake < 0 || nrequeue < 0)
+        return -1;
+
+    FutexBucket *b = _bucket(key), *b2 = _bucket(key2);
+    int n = 0;
+    _lock_two(b, b2);
+    if (cmp && _value(key) != val) {
+        _unlock_two(b, b2);
+        return -1;
+    }
+    for (ListNode *node = b->head.next; node != &b->head && n < (i64)nwake + nrequeue;) {
+        FutexWaiter *w = container_of(node, FutexWaiter, node);
+        node = node->next;
+        if (w->key != key)
+            continue;
+        if (n < nwake) {
+            _wake_waiter(w);
+        } else {
+            detach_from_list(&w->node);
+            w->key = key2;
+            w->bucket = b2;
+            merge_list(b2->head.prev, &w->node);
+        }
+        n++;
+    }
+    _unlock_two(b, b2);
+    return n;
+}
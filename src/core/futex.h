@@ -0,0 +1,17 @@
+#pragma once
+
+#include <common/defines.h>
+
+/* Operations of futex, as in Linux. */
+#define FUTEX_WAIT            0
+#define FUTEX_WAKE            1
+#define FUTEX_REQUEUE         3
+#define FUTEX_CMP_REQUEUE     4
+#define FUTEX_PRIVATE_FLAG    128
+#define FUTEX_CLOCK_REALTIME  256
+#define FUTEX_CMD_MASK        (~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME))
+
+void init_futex();
+int futex_wait(u32 *uaddr, u32 val, u64 expires);
+int futex_wake(u32 *uaddr, int n);
+int futex_requeue(u32 *uaddr, int nwake, int nrequeue, u32 *uaddr2, bool cmp, u32 val);
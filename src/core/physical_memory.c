@@ -1,13 +1,28 @@
 #include <aarch64/mmu.h>
 #include <common/defines.h>
 #include <common/spinlock.h>
+#include <common/string.h>
 #include <core/console.h>
+#include <core/container.h>
 #include <core/physical_memory.h>
 
 extern char end[];
 
 MemmoryManagerTable mmt;
 
+/* Selects the memory manager, before init_memory_manager. */
+int memory_manager = MM_BUDDY;
+
+/*
+ * Id of the container each page is charged to, 0 if none, see kalloc.
+ * Placed at the start of the memory handed to the memory manager.
+ */
+static u16 *page_owners;
+static void *pages_start;
+static usize nr_pages;
+
+static void _init_page_caches();
+
 /*
  * Editable, as long as it works as a memory manager.
  */
@@ -21,8 +36,10 @@ FreeList freelist;
 static void *freelist_alloc(void *this) {
     FreeList *f = (FreeList *)this;
     void *p = f->next;
-    if (p)
+    if (p) {
         f->next = *(void **)p;
+        f->nr_free--;
+    }
     // else
     //     PANIC;
     return p;
@@ -35,6 +52,7 @@ static void freelist_free(void *this, void *v) {
     FreeList *f = (FreeList *)this;
     *(void **)v = f->next;
     f->next = v;
+    f->nr_free++;
 }
 
 /*
@@ -48,11 +66,136 @@ static void init_freelist(void *this, void *start, void *end) {
     }
 }
 
+static void freelist_stat(void *this, usize nr_free[BUDDY_ORDERS]) {
+    FreeList *f = (FreeList *)this;
+    nr_free[0] = f->nr_free;
+    for (int i = 1; i < BUDDY_ORDERS; i++)
+        nr_free[i] = 0;
+}
+
+BuddyAllocator buddy;
+
+#define BUDDY_NOT_FREE 0xff
+
+static INLINE void *_buddy_page(BuddyAllocator *b, usize i) {
+    return b->base + i * PAGE_SIZE;
+}
+
+static INLINE usize _buddy_index(BuddyAllocator *b, void *v) {
+    return (usize)(v - b->base) / PAGE_SIZE;
+}
+
+/* Add the block starting at page i to the free blocks of its order. */
+static void _buddy_push(BuddyAllocator *b, usize i, int order) {
+    ListNode *node = _buddy_page(b, i);
+    init_list_node(node);
+    merge_list(&b->free[order], node);
+    b->order[i] = (u8)order;
+    b->nr_free[order]++;
+}
+
+static void _buddy_remove(BuddyAllocator *b, usize i, int order) {
+    detach_from_list((ListNode *)_buddy_page(b, i));
+    b->order[i] = BUDDY_NOT_FREE;
+    b->nr_free[order]--;
+}
+
+/*
+ * Allocate a block of 2^order pages, splitting the smallest larger free
+ * block if none is left, and handing its halves back one by one.
+ */
+static void *buddy_alloc_pages(void *this, int order) {
+    BuddyAllocator *b = (BuddyAllocator *)this;
+    int k = order;
+    while (k < BUDDY_ORDERS && b->nr_free[k] == 0)
+        k++;
+    if (k == BUDDY_ORDERS)
+        return NULL;
+    usize i = _buddy_index(b, b->free[k].next);
+    _buddy_remove(b, i, k);
+    while (k > order) {
+        k--;
+        _buddy_push(b, i + (1ul << k), k);
+    }
+    return _buddy_page(b, i);
+}
+
+/* Free a block of 2^order pages, merging it with its buddy while that is free. */
+static void buddy_free_pages(void *this, void *v, int order) {
+    BuddyAllocator *b = (BuddyAllocator *)this;
+    usize i = _buddy_index(b, v);
+    for (; order < BUDDY_ORDERS - 1; order++) {
+        usize j = i ^ (1ul << order);
+        if (j >= b->nr_pages || b->order[j] != order)
+            break;
+        _buddy_remove(b, j, order);
+        i &= ~(1ul << order);
+    }
+    _buddy_push(b, i, order);
+}
+
+static void *buddy_alloc(void *this) {
+    return buddy_alloc_pages(this, 0);
+}
+
+static void buddy_free(void *this, void *v) {
+    buddy_free_pages(this, v, 0);
+}
+
+/*
+ * Take the order of each page from the start of the memory, and hand the
+ * rest out in the largest blocks that are aligned. Page indices count from
+ * base, rounded down to the largest block, so that blocks are aligned to
+ * their size physically; the pages before the first one that is free are
+ * never handed out, and the head up to the first aligned block goes to the
+ * smaller orders.
+ */
+static void init_buddy(void *this, void *start, void *end) {
+    BuddyAllocator *b = (BuddyAllocator *)this;
+    usize max = 1ul << (BUDDY_ORDERS - 1);
+    usize n = (usize)(end - start) / PAGE_SIZE + max;
+    b->order = start;
+    void *first = (void *)round_up((u64)(b->order + n), PAGE_SIZE);
+    b->base = (void *)round_down((u64)first, max * PAGE_SIZE);
+    b->nr_pages = first < end ? (usize)(end - b->base) / PAGE_SIZE : 0;
+    memset(b->order, BUDDY_NOT_FREE, b->nr_pages);
+    for (int k = 0; k < BUDDY_ORDERS; k++) {
+        init_list_node(&b->free[k]);
+        b->nr_free[k] = 0;
+    }
+    for (usize i = _buddy_index(b, first); i < b->nr_pages;) {
+        int k = BUDDY_ORDERS - 1;
+        while (i % (1ul << k) != 0 || i + (1ul << k) > b->nr_pages)
+            k--;
+        _buddy_push(b, i, k);
+        i += 1ul << k;
+    }
+}
+
+static void buddy_stat(void *this, usize nr_free[BUDDY_ORDERS]) {
+    BuddyAllocator *b = (BuddyAllocator *)this;
+    for (int i = 0; i < BUDDY_ORDERS; i++)
+        nr_free[i] = b->nr_free[i];
+}
+
 static void init_memmory_manager_table(MemmoryManagerTable *mmt_ptr) {
+    if (memory_manager == MM_BUDDY) {
+        mmt_ptr->memmory_manager = (void *)&buddy;
+        mmt_ptr->page_init = init_buddy;
+        mmt_ptr->page_alloc = buddy_alloc;
+        mmt_ptr->page_free = buddy_free;
+        mmt_ptr->pages_alloc = buddy_alloc_pages;
+        mmt_ptr->pages_free = buddy_free_pages;
+        mmt_ptr->page_stat = buddy_stat;
+        return;
+    }
     mmt_ptr->memmory_manager = (void *)&freelist;
     mmt_ptr->page_init = init_freelist;
     mmt_ptr->page_alloc = freelist_alloc;
     mmt_ptr->page_free = freelist_free;
+    mmt_ptr->pages_alloc = NULL;
+    mmt_ptr->pages_free = NULL;
+    mmt_ptr->page_stat = freelist_stat;
 }
 
 void init_memory_manager() {
@@ -62,10 +205,27 @@ void init_memory_manager() {
 
     // notice here for roundup.
     void *roundup_end = (void *)round_up((u64)end, PAGE_SIZE);
+    nr_pages = (P2K(phystop) - (u64)roundup_end) / PAGE_SIZE;
+    page_owners = roundup_end;
+    memset(page_owners, 0, nr_pages * sizeof(u16));
+    roundup_end = (void *)round_up((u64)(page_owners + nr_pages), PAGE_SIZE);
+    pages_start = page_owners;
     init_memmory_manager_table(&mmt);
     mmt.page_init(mmt.memmory_manager, roundup_end, (void *)P2K(phystop));
 
     init_spinlock(&mmt.lock, "memory");
+    _init_page_caches();
+}
+
+static INLINE u16 *_owner(void *page) {
+    usize i = (usize)(page - pages_start) / PAGE_SIZE;
+    return page >= pages_start && i < nr_pages ? &page_owners[i] : NULL;
+}
+
+/* Id of the container the page is charged to, or 0 if none. */
+int page_owner(void *page) {
+    u16 *owner = _owner(page);
+    return owner ? __atomic_load_n(owner, __ATOMIC_RELAXED) : 0;
 }
 
 /*
@@ -77,21 +237,190 @@ void free_range(void *start, void *end) {
 }
 
 /*
- * Allocate a page of physical memory.
- * Returns 0 if failed else a pointer.
- * Corrupt the page by filling non-zero value in it for debugging.
+ * Each CPU keeps a magazine of free pages, so most calls of kalloc and
+ * kfree take no shared lock. An empty magazine is refilled to PCP_LOW
+ * pages, and one over PCP_HIGH drained back to PCP_LOW, the coldest pages
+ * first, holding mmt.lock once for the batch. A magazine has a lock of its
+ * own, which other CPUs only take to drain it when the memory manager runs
+ * out, so it is all but uncontended. It is taken before mmt.lock.
  */
-void *kalloc() {
+#define PCP_LOW  32
+#define PCP_HIGH 64
+
+typedef struct {
+    SpinLock lock;
+    int count;
+    void *pages[PCP_HIGH + 1]; /* Most recently freed last */
+} PageCache;
+
+static PageCache page_caches[NCPU];
+
+static void _init_page_caches() {
+    for (PageCache *pc = page_caches; pc < page_caches + NCPU; pc++)
+        init_spinlock(&pc->lock, "page cache");
+}
+
+static void _refill(PageCache *pc) {
     acquire_spinlock(&mmt.lock);
-    void *p = mmt.page_alloc(mmt.memmory_manager);
+    while (pc->count < PCP_LOW) {
+        void *p = mmt.page_alloc(mmt.memmory_manager);
+        if (p == NULL)
+            break;
+        pc->pages[pc->count++] = p;
+    }
+    release_spinlock(&mmt.lock);
+}
+
+/* Give all but keep pages of pc back to the memory manager. */
+static void _drain(PageCache *pc, int keep) {
+    int n = pc->count - keep;
+    if (n <= 0)
+        return;
+    acquire_spinlock(&mmt.lock);
+    for (int i = 0; i < n; i++)
+        mmt.page_free(mmt.memmory_manager, pc->pages[i]);
+    release_spinlock(&mmt.lock);
+    memmove(pc->pages, pc->pages + n, (usize)keep * sizeof(void *));
+    pc->count = keep;
+}
+
+/* Give the pages in the magazines of all CPUs back to the memory manager. */
+static void _drain_all() {
+    for (PageCache *pc = page_caches; pc < page_caches + NCPU; pc++) {
+        acquire_spinlock(&pc->lock);
+        _drain(pc, 0);
+        release_spinlock(&pc->lock);
+    }
+}
 
+static void *_try_page_alloc(int order) {
+    void *p = NULL;
+    if (order == 0) {
+        PageCache *pc = &page_caches[cpuid()];
+        acquire_spinlock(&pc->lock);
+        if (pc->count == 0)
+            _refill(pc);
+        if (pc->count > 0)
+            p = pc->pages[--pc->count];
+        release_spinlock(&pc->lock);
+        return p;
+    }
+    acquire_spinlock(&mmt.lock);
+    p = mmt.pages_alloc(mmt.memmory_manager, order);
     release_spinlock(&mmt.lock);
     return p;
 }
 
+static void *_page_alloc(int order) {
+    void *p = _try_page_alloc(order);
+    /* The magazines may hold the last pages, or those completing a block. */
+    if (p == NULL) {
+        _drain_all();
+        p = _try_page_alloc(order);
+    }
+    return p;
+}
+
+static void _page_free(void *va, int order) {
+    PageCache *pc = &page_caches[cpuid()];
+    if (order == 0) {
+        acquire_spinlock(&pc->lock);
+        pc->pages[pc->count++] = va;
+        if (pc->count > PCP_HIGH)
+            _drain(pc, PCP_LOW);
+        release_spinlock(&pc->lock);
+        return;
+    }
+    acquire_spinlock(&mmt.lock);
+    mmt.pages_free(mmt.memmory_manager, va, order);
+    release_spinlock(&mmt.lock);
+}
+
+static void _uncharge(struct container *c, usize n) {
+    for (; c != NULL && n > 0; n--)
+        mem_uncharge(c);
+}
+
+/*
+ * Allocate 2^order pages charged to c, or to no container if c is NULL.
+ * Fails if that puts c over its memory limit.
+ */
+static void *_alloc(int order, struct container *c) {
+    if (order < 0 || order >= BUDDY_ORDERS || (order > 0 && mmt.pages_alloc == NULL))
+        return NULL;
+    usize n = 1ul << order, charged = 0;
+    for (; c != NULL && charged < n; charged++) {
+        if (mem_charge(c) < 0) {
+            _uncharge(c, charged);
+            return NULL;
+        }
+    }
+
+    void *p = _page_alloc(order);
+    if (p == NULL) {
+        _uncharge(c, n);
+        return NULL;
+    }
+    for (usize i = 0; i < n; i++) {
+        u16 *owner = _owner(p + i * PAGE_SIZE);
+        if (owner != NULL)
+            __atomic_store_n(owner, c != NULL ? c->id : 0, __ATOMIC_RELAXED);
+    }
+    return p;
+}
+
+/*
+ * Allocate 2^order physically contiguous pages, physically aligned to
+ * their size. Returns 0 if failed else a pointer. Only
+ * MM_BUDDY hands out more than one page at a time.
+ * The pages are not charged to any container: the kernel must not fail
+ * for its own metadata because a container is at its limit.
+ */
+void *kalloc_pages(int order) {
+    return _alloc(order, NULL);
+}
+
+/*
+ * Allocate a page for the current process to use, as user memory or
+ * cached file data. It is charged to the container of the process, and
+ * allocation fails if that puts it over its memory limit.
+ */
+void *kalloc_charged() {
+    return _alloc(0, current_container());
+}
+
+/* Free the 2^order pages at va from kalloc_pages, uncharging their containers. */
+void kfree_pages(void *va, int order) {
+    for (usize i = 0; i < 1ul << order; i++) {
+        u16 *owner = _owner(va + i * PAGE_SIZE);
+        if (owner != NULL)
+            _uncharge(get_container(__atomic_exchange_n(owner, 0, __ATOMIC_RELAXED)), 1);
+    }
+
+    _page_free(va, order);
+}
+
+/*
+ * Allocate a page of physical memory.
+ * Returns 0 if failed else a pointer.
+ * Corrupt the page by filling non-zero value in it for debugging.
+ */
+void *kalloc() {
+    return kalloc_pages(0);
+}
+
 /* Free the physical memory pointed at by v. */
 void kfree(void *va) {
+    kfree_pages(va, 0);
+}
+
+/*
+ * Count the free blocks of each order, as in /proc/buddyinfo. Pages in
+ * the magazines of the CPUs are not counted, so free memory is short by
+ * up to PCP_HIGH pages per CPU, all of which kalloc still hands out.
+ */
+void get_free_pages(usize nr_free[BUDDY_ORDERS]) {
     acquire_spinlock(&mmt.lock);
-    mmt.page_free(mmt.memmory_manager, va);
+    mmt.page_stat(mmt.memmory_manager, nr_free);
     release_spinlock(&mmt.lock);
 }
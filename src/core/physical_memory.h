@@ -1,21 +1,55 @@
 #pragma once
 
+#include <common/list.h>
 #include <common/spinlock.h>
 
+/* Memory managers, one of which init_memory_manager sets up. */
+#define MM_FREELIST 0
+#define MM_BUDDY    1
+
+#define BUDDY_ORDERS 11 /* Blocks of 1 ... 1024 pages */
+
 typedef struct {
     void *memmory_manager;
     void (*page_init)(void *this, void *start, void *end);
     void *(*page_alloc)(void *this);
     void (*page_free)(void *this, void *v);
+    /* Blocks of 2^order pages, NULL if only single pages are managed. */
+    void *(*pages_alloc)(void *this, int order);
+    void (*pages_free)(void *this, void *v, int order);
+    /* Count the free blocks of each order. */
+    void (*page_stat)(void *this, usize nr_free[BUDDY_ORDERS]);
     SpinLock lock;
 } MemmoryManagerTable;
 
 typedef struct {
     void *next;
     void *start, *end;
+    usize nr_free;
 } FreeList;
 
+/*
+ * Free blocks of 2^order pages, for each order, are linked through their
+ * first page. A block is aligned to its size from base, which is aligned to
+ * the largest block, so its buddy, the other half of the block one order
+ * up, is found by flipping one bit of its page index.
+ */
+typedef struct {
+    ListNode free[BUDDY_ORDERS];
+    usize nr_free[BUDDY_ORDERS];
+    void *base;
+    usize nr_pages;
+    u8 *order; /* Of the free block a page starts, BUDDY_NOT_FREE if none */
+} BuddyAllocator;
+
+extern int memory_manager;
+
 void init_memory_manager();
 void free_range(void *start, void *end);
 void *kalloc();
 void kfree(void *va);
+void *kalloc_pages(int order);
+void *kalloc_charged();
+void kfree_pages(void *va, int order);
+void get_free_pages(usize nr_free[BUDDY_ORDERS]);
+int page_owner(void *page);
@@ -0,0 +1,95 @@
+#include <core/console.h>
+#include <core/physical_memory.h>
+#include <core/pid.h>
+#include <core/proc.h>
+
+#define PID_CELLS BITMAP_TO_NUM_CELLS(PID_MAX)
+
+/*
+ * Set up ns, nested in parent unless it is NULL. Returns 0, or -1 if there
+ * is no page for the bitmap or containers are nested too deep.
+ */
+int init_pid_namespace(struct pid_namespace *ns, struct pid_namespace *parent) {
+    int level = parent ? parent->level + 1 : 0;
+    if (level >= PIDNS_LEVELS || (ns->bitmap = kalloc()) == NULL)
+        return -1;
+    init_bitmap(ns->bitmap, PID_MAX);
+    bitmap_set(ns->bitmap, 0);
+    init_spinlock(&ns->lock, "pid namespace");
+    ns->level = level;
+    ns->parent = parent;
+    ns->last_pid = 0;
+    ns->nr_free = PID_MAX - 1;
+    ns->child_reaper = NULL;
+    return 0;
+}
+
+/* Find the first clear bit after last_pid, wrapping around. */
+static int _alloc_nr(struct pid_namespace *ns) {
+    int nr = -1;
+    acquire_spinlock(&ns->lock);
+    if (ns->nr_free > 0) {
+        usize start = (usize)(ns->last_pid + 1) % PID_MAX;
+        for (usize i = 0; i <= PID_CELLS; i++) {
+            usize idx = (start / BITMAP_BITS_PER_CELL + i) % PID_CELLS;
+            BitmapCell free = ~ns->bitmap[idx];
+            /* Bits before start are only taken after wrapping around. */
+            if (i == 0)
+                free &= ~0ull << (start % BITMAP_BITS_PER_CELL);
+            if (free != 0) {
+                nr = (int)(idx * BITMAP_BITS_PER_CELL + (usize)__builtin_ctzll(free));
+                break;
+            }
+        }
+        assert(nr > 0);
+        bitmap_set(ns->bitmap, (usize)nr);
+        ns->last_pid = nr;
+        ns->nr_free--;
+    }
+    release_spinlock(&ns->lock);
+    return nr;
+}
+
+static void _free_nr(struct pid_namespace *ns, int nr) {
+    acquire_spinlock(&ns->lock);
+    bitmap_clear(ns->bitmap, (usize)nr);
+    ns->nr_free++;
+    release_spinlock(&ns->lock);
+}
+
+/*
+ * Give p a pid in ns and in each namespace above it, taking the lock of
+ * one at a time. Returns 0, or -1 if one of them has run out of pids.
+ */
+int alloc_pid(struct pid_namespace *ns, struct proc *p) {
+    int level = ns->level;
+    for (; ns != NULL; ns = ns->parent) {
+        int nr = _alloc_nr(ns);
+        if (nr < 0) {
+            for (int i = ns->level + 1; i <= level; i++)
+                _free_nr(p->pids[i].ns, p->pids[i].nr);
+            return -1;
+        }
+        p->pids[ns->level].nr = nr;
+        p->pids[ns->level].ns = ns;
+    }
+    p->pid_level = level;
+    p->pid = p->pids[level].nr;
+    return 0;
+}
+
+/* Release the pids of p in all namespaces, for reuse. */
+void free_pid(struct proc *p) {
+    if (p->pid == 0)
+        return;
+    for (int i = 0; i <= p->pid_level; i++)
+        _free_nr(p->pids[i].ns, p->pids[i].nr);
+    p->pid = 0;
+}
+
+/* The pid of p in ns, or 0 if p is not seen from there. */
+int pid_nr_ns(struct proc *p, struct pid_namespace *ns) {
+    if (ns->level > p->pid_level || p->pids[ns->level].ns != ns)
+        return 0;
+    return p->pids[ns->level].nr;
+}
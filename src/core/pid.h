@@ -0,0 +1,41 @@
+#pragma once
+
+#include <aarch64/mmu.h>
+#include <common/bitmap.h>
+#include <common/spinlock.h>
+
+/*
+ * Each container has a pid namespace, nested like the containers. A process
+ * has a pid in the namespace of its scheduler and in every one above it, up
+ * to that of the root container at level 0, all kept in the process so any
+ * of them is found in O(1). Pids of a namespace come from a bitmap a page
+ * long, searched from the last pid allocated on, so a pid is reused only
+ * once those after it have been. The first process of a namespace is its
+ * child reaper, the init of the container, and adopts the orphans of the
+ * namespace. It hands the role on when it exits, see _reparent_children.
+ */
+#define PID_MAX      (PAGE_SIZE * 8) /* pids are 1 ... PID_MAX - 1 */
+#define PIDNS_LEVELS 8               /* levels of nested containers */
+
+struct pid_namespace {
+    SpinLock lock;
+    int level;                    /* 0 in the root container */
+    struct pid_namespace *parent; /* NULL in the root container */
+    int last_pid;                 /* Last one allocated */
+    int nr_free;
+    BitmapCell *bitmap;        /* A page, bit i set if pid i is in use */
+    struct proc *child_reaper; /* Guarded by the ptable lock of its scheduler */
+};
+
+/* The pid of a process in one namespace. */
+struct upid {
+    int nr;
+    struct pid_namespace *ns;
+};
+
+struct proc;
+
+int init_pid_namespace(struct pid_namespace *ns, struct pid_namespace *parent);
+int alloc_pid(struct pid_namespace *ns, struct proc *p);
+void free_pid(struct proc *p);
+int pid_nr_ns(struct proc *p, struct pid_namespace *ns);
@@ -2,10 +2,13 @@
 #include <common/spinlock.h>
 #include <common/string.h>
 #include <core/console.h>
+#include <core/futex.h>
 #include <core/physical_memory.h>
 #include <core/proc.h>
 #include <core/sched.h>
+#include <core/syscall.h>
 #include <core/virtual_memory.h>
+#include <driver/interrupt.h>
 #include <driver/sd.h>
 #include <fs/file.h>
 #include <fs/fs.h>
@@ -15,8 +18,15 @@ void forkret();
 extern void trap_return();
 volatile int flag_atom = 0;
 
+static void _free_embryo(struct proc *p) {
+    struct scheduler *s = thiscpu()->scheduler;
+    acquire_spinlock(&s->ptable.lock);
+    free_pcb(s, p);
+    release_spinlock(&s->ptable.lock);
+}
+
 /*
- * Look through the process table for an UNUSED proc.
+ * Look through the process table for a free slot.
  * If found, change state to EMBRYO and initialize
  * state (allocate stack, clear trapframe, set context for switch...)
  * required to run in the kernel. Otherwise return 0.
@@ -25,16 +35,14 @@ static struct proc *alloc_proc() {
     struct proc *p;
     p = alloc_pcb();
     if (p == NULL) {
-        PANIC("no free pcbs\n");
+        return NULL;
     }
 
-    p->pgdir = pgdir_init();
-    // memset(p->pgdir, 0, PGSIZE);
-
     // kstack
     char *sp = kalloc();
     if (sp == NULL) {
-        PANIC("proc_alloc: cannot alloc kstack");
+        _free_embryo(p);
+        return NULL;
     }
     p->kstack = sp;
     sp += KSTACKSIZE;
@@ -70,13 +78,17 @@ void spawn_init_process() {
     struct proc *p;
     extern char icode[], eicode[];
     p = alloc_proc();
+    if (p == NULL) {
+        PANIC("no free pcbs\n");
+    }
+    p->mm = mm_alloc();
 
     char *r = kalloc();
-    if (r == NULL) {
+    if (p->mm == NULL || r == NULL) {
         PANIC("uvm_init: cannot alloc a page");
     }
     memset(r, 0, PAGE_SIZE);
-    uvm_map(p->pgdir, (void *)0, PAGE_SIZE, K2P(r));
+    uvm_map(p->mm->pgdir, (void *)0, PAGE_SIZE, K2P(r));
     memmove(r, (void *)icode, (usize)(eicode - icode));
 
     memset(p->tf, 0, sizeof(*(p->tf)));
@@ -84,9 +96,9 @@ void spawn_init_process() {
     p->tf->sp = PAGE_SIZE;
     p->tf->x[30] = 0;
     p->tf->elr = 0;
-    p->sz = PAGE_SIZE;
+    p->mm->sz = PAGE_SIZE;
 
-    p->state = RUNNABLE;
+    activate(p);
 }
 
 /*
@@ -104,49 +116,168 @@ void forkret() {
     }
 }
 
+static bool _reapable(struct scheduler *s, struct proc *p);
+static void _free_zombie(struct scheduler *s, struct proc *p);
+
 /*
- * Exit the current process.  Does not return.
- * An exited process remains in the zombie state
- * until its parent calls wait() to find out it exited.
+ * The child reaper of the namespace of leader, other than leader. If it
+ * is leader that exits, or there is none yet, the role passes to the
+ * oldest process of s still alive, the first of the namespace left, as
+ * the ptable is in the order of allocation. Returns NULL if leader is the
+ * last one. Must hold the ptable lock.
  */
-void wakeup_withlock(void *chan);
-NO_RETURN void exit() {
-    struct proc *p = thiscpu()->proc;
-    // if (p == initproc) {
-    //     PANIC("exit: init process shall not exit!");
-    // }
-
-    for (int fd = 0; fd < NOFILE; fd++) {
-        if (thiscpu()->proc->ofile[fd]) {
-            fileclose(thiscpu()->proc->ofile[fd]);
-            thiscpu()->proc->ofile[fd] = 0;
+static struct proc *_child_reaper(struct scheduler *s, struct proc *leader) {
+    struct pid_namespace *ns = leader->pids[leader->pid_level].ns;
+    struct proc *reaper = ns->child_reaper;
+    if (reaper != NULL && reaper != leader)
+        return reaper;
+    reaper = NULL;
+    for (ListNode *node = s->ptable.procs.next; node != &s->ptable.procs; node = node->next) {
+        struct proc *p = container_of(node, struct proc, ptable_node);
+        if (p != leader && p->group_leader == p && !p->is_scheduler && p->state != EMBRYO &&
+            __atomic_load_n(&p->nr_threads, __ATOMIC_ACQUIRE) > 0) {
+            reaper = p;
+            break;
         }
     }
-    OpContext ctx;
-    bcache.begin_op(&ctx);
-    inodes.put(&ctx, thiscpu()->proc->cwd);
-    bcache.end_op(&ctx);
+    ns->child_reaper = reaper;
+    return reaper;
+}
 
-    thiscpu()->proc->cwd = 0;
-    acquire_sched_lock();
-    wakeup_withlock(p->parent);
-    for (struct proc *p = thiscpu()->scheduler->ptable.proc;
-         p < thiscpu()->scheduler->ptable.proc + NPROC;
-         p++) {
-        if (p->parent == thiscpu()->proc) {
-            // p->parent = initproc;
-            if (p->state == ZOMBIE) {
-                wakeup_withlock(p->parent);
-            }
+/*
+ * Hand the children of leader, whose threads have all exited, to reaper.
+ * Without one, nobody could wait for them, and the zombies among them are
+ * freed here. Must hold the ptable lock.
+ */
+static void _reparent_children(struct scheduler *s, struct proc *leader, struct proc *reaper) {
+    bool zombies = false;
+    while (leader->children.next != &leader->children) {
+        struct proc *child = container_of(leader->children.next, struct proc, sibling_node);
+        bool zombie = child->zombie_node.next != &child->zombie_node;
+        if (reaper == NULL && _reapable(s, child)) {
+            _free_zombie(s, child);
+            continue;
+        }
+        detach_from_list(&child->sibling_node);
+        detach_from_list(&child->zombie_node);
+        child->parent = reaper;
+        if (reaper == NULL)
+            continue;
+        merge_list(reaper->children.prev, &child->sibling_node);
+        if (zombie)
+            merge_list(reaper->zombies.prev, &child->zombie_node);
+        zombies |= zombie;
+    }
+    if (zombies)
+        wakeup(reaper);
+}
+
+/*
+ * Exit the current process with status, as wait reports it. Does not
+ * return. An exited process remains in the zombie state until its
+ * parent calls wait() to find out it exited.
+ * The last thread to exit closes the files of the group, hands its
+ * children to the child reaper of its namespace and queues the group on
+ * the zombies of the parent. A group without a parent, at the top of its
+ * container, is an orphan itself and goes to the reaper too.
+ */
+NO_RETURN void exit(int status) {
+    struct proc *p = thiscpu()->proc, *leader = p->group_leader;
+    struct scheduler *s = thiscpu()->scheduler;
+    SpinLock *ptable_lock = &s->ptable.lock;
+
+    int zero = 0;
+    if (p->clear_child_tid != NULL &&
+        copy_to_user((u64)p->clear_child_tid, &zero, sizeof(zero)) == 0)
+        futex_wake((u32 *)p->clear_child_tid, 1);
+    mm_release(p->mm);
+    fpsimd_release(p);
+    bool last = __atomic_sub_fetch(&leader->nr_threads, 1, __ATOMIC_ACQ_REL) == 0;
+    if (last) {
+        fdtable_close_all(&leader->fdtable);
+        OpContext ctx;
+        bcache.begin_op(&ctx);
+        inodes.put(&ctx, leader->cwd);
+        bcache.end_op(&ctx);
+        leader->cwd = 0;
+    }
+
+    acquire_spinlock(ptable_lock);
+    if (p == leader && !leader->group_exit)
+        leader->exit_status = status;
+    if (last) {
+        struct proc *reaper = _child_reaper(s, leader);
+        _reparent_children(s, leader, reaper);
+        if (leader->parent == NULL && reaper != NULL) {
+            leader->parent = reaper;
+            merge_list(reaper->children.prev, &leader->sibling_node);
         }
+        if (leader->parent != NULL)
+            merge_list(leader->parent->zombies.prev, &leader->zombie_node);
     }
-    // release_sched_lock();
+    /* The leader may still be on its way out when the last thread queues it. */
+    wakeup(leader->parent);
+
+    /* wait() frees our stack only after we release the scheduler lock. */
+    if (sched_lock() != ptable_lock)
+        acquire_sched_lock();
     p->state = ZOMBIE;
+    if (sched_lock() != ptable_lock)
+        release_spinlock(ptable_lock);
     sched();
 
     PANIC("exit should not return\n");
 }
 
+/*
+ * Make the other threads of the group of the current process exit, as
+ * they next return to user space. Running ones are interrupted for that,
+ * and sleeping ones woken.
+ */
+static void _kill_thread(struct proc *p) {
+    if (p == thiscpu()->proc || p->state == ZOMBIE)
+        return;
+    p->killed = 1;
+    /* Sleepers check their condition again, so waking others does no harm. */
+    void *chan = p->chan;
+    if (p->state == SLEEPING && chan != NULL)
+        wakeup(chan);
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        if (cpus[cpu].proc == p) {
+            cpus[cpu].need_resched = true;
+            if (cpu != (int)cpuid())
+                send_ipi((usize)cpu);
+        }
+    }
+}
+
+void kill_other_threads() {
+    struct proc *leader = thiscpu()->proc->group_leader;
+    struct scheduler *s = thiscpu()->scheduler;
+    acquire_spinlock(&s->ptable.lock);
+    _kill_thread(leader);
+    for (ListNode *node = leader->threads.next; node != &leader->threads; node = node->next)
+        _kill_thread(container_of(node, struct proc, thread_node));
+    release_spinlock(&s->ptable.lock);
+}
+
+/*
+ * Exit all threads of the current process. Does not return. The status
+ * of the first call is the one reported, whichever thread exits last.
+ */
+NO_RETURN void exit_group(int status) {
+    struct proc *leader = thiscpu()->proc->group_leader;
+    SpinLock *ptable_lock = &thiscpu()->scheduler->ptable.lock;
+    acquire_spinlock(ptable_lock);
+    if (!leader->group_exit) {
+        leader->group_exit = true;
+        leader->exit_status = status;
+    }
+    release_spinlock(ptable_lock);
+    kill_other_threads();
+    exit(status);
+}
+
 /*
  * Give up CPU.
  * Switch to the scheduler of this proc.
@@ -158,50 +289,117 @@ void yield() {
     release_sched_lock();
 }
 
+/*
+ * Give up CPU involuntarily, on a tick or for a more urgent process.
+ * Unlike yield, a SCHED_FIFO process keeps its place in the queue.
+ */
+void preempt() {
+    acquire_sched_lock();
+    thiscpu()->proc->state = RUNNABLE;
+    thiscpu()->proc->preempted = true;
+    sched();
+    release_sched_lock();
+}
+
+/*
+ * Sleeping processes wait on a list hashed by their channel, so a wakeup
+ * only visits processes sleeping on channels of the same bucket.
+ * Lock order: the sleeper's lock, scheduler lock, bucket lock. A waker
+ * drops the bucket lock before taking any scheduler lock.
+ */
+#define NWAITQ 64
+static struct {
+    SpinLock lock;
+    ListNode head;
+} waitq[NWAITQ];
+
+void init_proc() {
+    for (int i = 0; i < NWAITQ; i++) {
+        init_spinlock(&waitq[i].lock, "waitq");
+        init_list_node(&waitq[i].head);
+    }
+}
+
+static INLINE usize _waitq_hash(void *chan) {
+    return (usize)(((u64)chan * 0x9e3779b97f4a7c15ull) >> 58) % NWAITQ;
+}
+
 void sleep(void *chan, SpinLock *lock) {
+    struct proc *p = thiscpu()->proc;
+    usize h = _waitq_hash(chan);
     if (!holding_spinlock(lock)) {
         PANIC("sleep: lock not held");
     }
 
-    // change the state of ptable, add lock
-    if (lock != &thiscpu()->scheduler->ptable.lock) {
+    /*
+     * Go to sleep before dropping lock, so that a wakeup issued after
+     * changing the condition under lock always finds us queued.
+     */
+    if (lock != sched_lock())
         acquire_sched_lock();
+    acquire_spinlock(&waitq[h].lock);
+    p->chan = chan;
+    p->state = SLEEPING;
+    merge_list(waitq[h].head.prev, &p->wait_node);
+    release_spinlock(&waitq[h].lock);
+    if (lock != sched_lock())
         release_spinlock(lock);
-    }
-
-    thiscpu()->proc->chan = chan;
-    thiscpu()->proc->state = SLEEPING;
     sched();
 
     // sched returns
-    thiscpu()->proc->chan = 0;
+    p->chan = 0;
 
-    if (lock != &thiscpu()->scheduler->ptable.lock) {
+    if (lock != sched_lock()) {
         release_sched_lock();
         acquire_spinlock(lock);
     }
 }
 
-void wakeup(void *chan) {
-    acquire_sched_lock();
-    for (struct proc *p = thiscpu()->scheduler->ptable.proc;
-         p < thiscpu()->scheduler->ptable.proc + NPROC;
-         p++) {
-        if (p->state == SLEEPING && p->chan == chan) {
-            p->state = RUNNABLE;
+/*
+ * Wake up the processes sleeping on chan, in the order they went to sleep.
+ * At most one if one is set. They are taken off the bucket first and made
+ * RUNNABLE under their scheduler lock, which the caller may already hold.
+ */
+static void _wakeup(void *chan, bool one) {
+    usize h = _waitq_hash(chan);
+    ListNode woken;
+    init_list_node(&woken);
+
+    acquire_spinlock(&waitq[h].lock);
+    for (ListNode *node = waitq[h].head.next; node != &waitq[h].head;) {
+        struct proc *p = container_of(node, struct proc, wait_node);
+        node = node->next;
+        if (p->chan == chan) {
+            detach_from_list(&p->wait_node);
+            merge_list(woken.prev, &p->wait_node);
+            if (one)
+                break;
         }
     }
-    release_sched_lock();
+    release_spinlock(&waitq[h].lock);
+
+    while (woken.next != &woken) {
+        struct proc *p = container_of(woken.next, struct proc, wait_node);
+        struct scheduler *s = p->scheduler;
+        SpinLock *lock = s->op->get_lock(s, p);
+        bool held = holding_spinlock(lock);
+        detach_from_list(&p->wait_node);
+        /* Taking the lock also waits for p to be off its stack. */
+        if (!held)
+            acquire_spinlock(lock);
+        s->op->activate(s, p);
+        if (!held)
+            release_spinlock(lock);
+    }
 }
 
-void wakeup_withlock(void *chan) {
-    for (struct proc *p = thiscpu()->scheduler->ptable.proc;
-         p < thiscpu()->scheduler->ptable.proc + NPROC;
-         p++) {
-        if (p->state == SLEEPING && p->chan == chan) {
-            p->state = RUNNABLE;
-        }
-    }
+void wakeup(void *chan) {
+    _wakeup(chan, false);
+}
+
+/* Wake the longest sleeper on chan only, to hand over a lock. */
+void wakeup_one(void *chan) {
+    _wakeup(chan, true);
 }
 
 void add_loop_test(int times) {
@@ -209,13 +407,17 @@ void add_loop_test(int times) {
         struct proc *p;
         extern char loop_start[], loop_end[];
         p = alloc_proc();
+        if (p == NULL) {
+            PANIC("no free pcbs\n");
+        }
+        p->mm = mm_alloc();
 
         char *r = kalloc();
-        if (r == NULL) {
+        if (p->mm == NULL || r == NULL) {
             PANIC("uvm_init: cannot alloc a page");
         }
         memset(r, 0, PAGE_SIZE);
-        uvm_map(p->pgdir, (void *)0, PAGE_SIZE, K2P(r));
+        uvm_map(p->mm->pgdir, (void *)0, PAGE_SIZE, K2P(r));
         memmove(r, (void *)loop_start, (usize)(loop_end - loop_start));
 
         memset(p->tf, 0, sizeof(*(p->tf)));
@@ -224,129 +426,241 @@ void add_loop_test(int times) {
         p->tf->x[30] = 0;
         p->tf->elr = 0;
 
-        p->state = RUNNABLE;
+        activate(p);
     }
 }
 
-void idle_init() {
-    struct proc *p;
-    extern char ispin[], eicode[];
-    p = alloc_proc();
-
-    char *r = kalloc();
-    if (r == NULL) {
-        PANIC("uvm_init: cannot alloc a page");
-    }
-    memset(r, 0, PAGE_SIZE);
-    uvm_map(p->pgdir, (void *)0, PAGE_SIZE, K2P(r));
-    memmove(r, (void *)ispin, (usize)(eicode - ispin));
-
-    memset(p->tf, 0, sizeof(*(p->tf)));
-    p->tf->spsr = 0;
-    p->tf->sp = PAGE_SIZE;
-    p->tf->x[30] = 0;
-    p->tf->elr = 0;
-    p->sz = PAGE_SIZE;
-
-    p->state = RUNNABLE;
-}
-
 int growproc(int n) {
+    struct mm *mm = thiscpu()->proc->mm;
     u32 sz;
 
-    sz = (u32)thiscpu()->proc->sz;
+    acquire_sleeplock(&mm->lock);
+    sz = (u32)mm->sz;
 
     if (n > 0) {
-        if ((sz = (u32)uvm_alloc(thiscpu()->proc->pgdir, 0, 0, sz, sz + (u32)n)) == 0) {
+        /* The heap must not grow into the mmap area. */
+        if ((u64)sz + (u64)n > MMAP_BASE ||
+            (sz = (u32)uvm_alloc(mm->pgdir, 0, 0, sz, sz + (u32)n)) == 0) {
+            release_sleeplock(&mm->lock);
             return -1;
         }
 
     } else if (n < 0) {
-        if ((sz = (u32)uvm_dealloc(thiscpu()->proc->pgdir, 0, sz, sz + (u32)n)) == 0) {
+        if ((sz = (u32)uvm_dealloc(mm->pgdir, 0, sz, sz + (u32)n)) == 0) {
+            release_sleeplock(&mm->lock);
             return -1;
         }
     }
 
-    thiscpu()->proc->sz = sz;
-    uvm_switch(thiscpu()->proc->pgdir);
+    mm->sz = sz;
+    release_sleeplock(&mm->lock);
+    /* This also flushes the TLBs of other threads. */
+    uvm_switch(mm->pgdir);
 
     return 0;
 }
 
 /*
- * Create a new process copying p as the parent.
- * Sets up stack to return as if from system call.
- * Caller must set state of returned proc to RUNNABLE.
+ * Free p, a zombie, once it is off its kernel stack. Must hold the
+ * ptable lock.
  */
-int fork() {
-    /* TODO: Your code here. */
+static void _free_zombie(struct scheduler *s, struct proc *p) {
+    SpinLock *lock = s->op->get_lock(s, p);
+    if (lock != &s->ptable.lock)
+        wait_spinlock(lock);
+    mm_put(p->mm);
+    kfree(p->kstack);
+    free_pcb(s, p);
+}
+
+/*
+ * Threads are not waited for. Free those of the group of leader that
+ * exited, adding their times to it, and return the number left. Must
+ * hold the ptable lock.
+ */
+static int _reap_threads(struct scheduler *s, struct proc *leader) {
+    int left = 0;
+    for (ListNode *node = leader->threads.next; node != &leader->threads;) {
+        struct proc *p = container_of(node, struct proc, thread_node);
+        node = node->next;
+        if (p->state != ZOMBIE) {
+            left++;
+            continue;
+        }
+        leader->utime += p->utime;
+        leader->stime += p->stime;
+        _free_zombie(s, p);
+    }
+    return left;
+}
+
+/*
+ * Create a new process copying the current one, as clone(2) does.
+ * With CLONE_VM it shares the address space, and with CLONE_THREAD it
+ * also joins the thread group. It returns to user space on stack, or
+ * the stack of the caller if 0, with x0 being 0 and, with CLONE_SETTLS,
+ * TPIDR_EL0 being tls. With CLONE_PARENT_SETTID its pid is stored at
+ * ptid, and with CLONE_CHILD_CLEARTID ctid is cleared when it exits.
+ * The caller checks flags and pointers. Returns the pid, or -1.
+ */
+int clone(int flags, u64 stack, int *ptid, u64 tls, int *ctid) {
+    struct scheduler *s = thiscpu()->scheduler;
+    struct proc *curproc = thiscpu()->proc, *leader = curproc->group_leader;
+    bool thread = (flags & CLONE_THREAD) != 0;
+
+    /* Make room for the new thread. */
+    if (thread) {
+        acquire_spinlock(&s->ptable.lock);
+        _reap_threads(s, leader);
+        release_spinlock(&s->ptable.lock);
+    }
+
     struct proc *p = alloc_proc();
     if (p == 0) {
         return -1;
     }
 
-    // uvm copy
-    p->pgdir = uvm_copy(thiscpu()->proc->pgdir);
-    if (p->pgdir == 0) {
+    p->mm = (flags & CLONE_VM) ? mm_share(curproc->mm) : mm_copy(curproc->mm);
+    if (p->mm == NULL) {
         kfree(p->kstack);
-        p->kstack = 0;
-        p->state = UNUSED;
+        _free_embryo(p);
         return -1;
     }
 
-    p->sz = thiscpu()->proc->sz;
+    p->nice = curproc->nice;
+    p->policy = curproc->policy;
+    p->rt_priority = curproc->rt_priority;
+    p->cpus_allowed = curproc->cpus_allowed;
     // *(p->tf) = *(thiscpu()->proc->tf);
-    memcpy(p->tf, thiscpu()->proc->tf, sizeof(*p->tf));
+    memcpy(p->tf, curproc->tf, sizeof(*p->tf));
     p->tf->x[0] = 0;
-    p->parent = thiscpu()->proc;
+    if (stack != 0)
+        p->tf->sp = stack;
+    if (flags & CLONE_SETTLS)
+        p->tf->tpidr = tls;
+    if (flags & CLONE_CHILD_CLEARTID)
+        p->clear_child_tid = ctid;
 
     // file descriptor
-    for (int i = 0; i < NOFILE; i++) {
-        if (thiscpu()->proc->ofile[i]) {
-            p->ofile[i] = filedup(thiscpu()->proc->ofile[i]);
-        }
+    init_fdtable(&p->fdtable);
+    if (fpsimd_fork(p, curproc) < 0 ||
+        (!thread && fdtable_copy(&p->fdtable, &leader->fdtable) < 0)) {
+        fdtable_close_all(&p->fdtable);
+        mm_release(p->mm);
+        mm_put(p->mm);
+        kfree(p->kstack);
+        _free_embryo(p);
+        return -1;
     }
 
-    p->cwd = inodes.share(thiscpu()->proc->cwd);
-    p->state = RUNNABLE;
+    if (!thread)
+        p->cwd = inodes.share(leader->cwd);
+    acquire_spinlock(&s->ptable.lock);
+    if (thread) {
+        p->group_leader = leader;
+        p->parent = leader->parent;
+        __atomic_add_fetch(&leader->nr_threads, 1, __ATOMIC_ACQ_REL);
+        merge_list(leader->threads.prev, &p->thread_node);
+    } else {
+        p->parent = leader;
+        merge_list(leader->children.prev, &p->sibling_node);
+    }
+    release_spinlock(&s->ptable.lock);
+    /* Checked by sys_clone, but another thread may have unmapped it since. */
+    if (flags & CLONE_PARENT_SETTID)
+        copy_to_user((u64)ptid, &p->pid, sizeof(*ptid));
+    activate(p);
 
     return p->pid;
 }
 
 /*
- * Wait for a child process to exit and return its pid.
- * Return -1 if this process has no children.
+ * Create a new process copying p as the parent.
+ * Sets up stack to return as if from system call.
  */
-int wait() {
-    /* TODO: Your code here. */
-    acquire_sched_lock();
+int fork() {
+    return clone(0, 0, NULL, 0, NULL);
+}
+
+/*
+ * Find a live process of this scheduler by pid, 0 meaning the caller.
+ * Must hold the ptable lock, which keeps the result from being freed.
+ */
+struct proc *find_proc(int pid) {
+    if (pid == 0)
+        return thiscpu()->proc;
+    struct proc *p = lookup_pcb(thiscpu()->scheduler, pid);
+    return p != NULL && p->state != ZOMBIE ? p : NULL;
+}
+
+/*
+ * Whether p, a child queued as a zombie, can be freed, freeing its
+ * exited threads on the way. Must hold the ptable lock.
+ */
+static bool _reapable(struct scheduler *s, struct proc *p) {
+    return p->zombie_node.next != &p->zombie_node && p->state == ZOMBIE &&
+           _reap_threads(s, p) == 0;
+}
+
+/*
+ * Wait for a child process to exit, free it and return its pid.
+ * pid > 0 waits for that child only, and otherwise any child will do,
+ * as there are no process groups. Unless NULL, status is set to the
+ * exit status of the child, and utime and stime to its times and those
+ * of the children it waited for.
+ * Return 0 if options has WNOHANG and no child has exited yet, and
+ * -1 if this process has no such children.
+ * The children of a process are those of its thread group, and one
+ * has exited when all its threads have.
+ */
+int wait(int pid, int options, int *status, u64 *utime, u64 *stime) {
+    struct scheduler *s = thiscpu()->scheduler;
+    struct proc *self = thiscpu()->proc, *leader = self->group_leader;
+    SpinLock *ptable_lock = &s->ptable.lock;
+    acquire_spinlock(ptable_lock);
     while (1) {
-        int havekids = 0;
-        for (struct proc *p = thiscpu()->scheduler->ptable.proc;
-             p < thiscpu()->scheduler->ptable.proc + NPROC;
-             p++) {
-            if (p->parent != thiscpu()->proc) {
-                continue;
-            }
-            havekids = 1;
-            if (p->state == ZOMBIE) {
-                int pid = p->pid;
-
-                p->killed = 0;
-                p->state = UNUSED;
-                p->pid = 0;
-                p->parent = 0;
-                vm_free(p->pgdir);
-                kfree(p->kstack);
-
-                release_sched_lock();
-                return pid;
+        struct proc *p = NULL;
+        if (pid > 0) {
+            p = lookup_pcb(s, pid);
+            if (p == NULL || p->parent != leader || p->group_leader != p)
+                break;
+            if (!_reapable(s, p))
+                p = NULL;
+        } else {
+            if (leader->children.next == &leader->children)
+                break;
+            for (ListNode *node = leader->zombies.next; node != &leader->zombies;
+                 node = node->next) {
+                p = container_of(node, struct proc, zombie_node);
+                if (_reapable(s, p))
+                    break;
+                p = NULL;
             }
         }
-        if (havekids == 0 || thiscpu()->proc->killed) {
-            release_sched_lock();
-            return -1;
+
+        if (p != NULL) {
+            int child = p->pid;
+            if (status != NULL)
+                *status = p->exit_status;
+            if (utime != NULL)
+                *utime = p->utime + p->cutime;
+            if (stime != NULL)
+                *stime = p->stime + p->cstime;
+            self->cutime += p->utime + p->cutime;
+            self->cstime += p->stime + p->cstime;
+            _free_zombie(s, p);
+
+            release_spinlock(ptable_lock);
+            return child;
+        }
+        if (options & WNOHANG) {
+            release_spinlock(ptable_lock);
+            return 0;
         }
-        sleep(thiscpu()->proc, &thiscpu()->scheduler->ptable.lock);
+        if (self->killed)
+            break;
+        sleep(leader, ptable_lock);
     }
+    release_spinlock(ptable_lock);
+    return -1;
 }
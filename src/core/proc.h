@@ -1,17 +1,45 @@
 #pragma once
 
 #include <common/defines.h>
+#include <common/list.h>
 // #include <core/sched.h>
 #include <common/spinlock.h>
+#include <core/fpsimd.h>
+#include <core/pid.h>
 #include <core/trapframe.h>
+#include <core/virtual_memory.h>
+#include <fs/file.h>
 #include <fs/inode.h>
 
-#define NPROC      14   /* maximum number of processes */
-#define NOFILE     8    /* open files per process */
+#define NPROC      14   /* process slots of sched_simple.c */
 #define KSTACKSIZE 4096 /* size of per-process kernel stack */
 
+/* Flags of clone, as in Linux. */
+#define CLONE_VM             0x00000100
+#define CLONE_FS             0x00000200
+#define CLONE_FILES          0x00000400
+#define CLONE_SIGHAND        0x00000800
+#define CLONE_VFORK          0x00004000
+#define CLONE_THREAD         0x00010000
+#define CLONE_SYSVSEM        0x00040000
+#define CLONE_SETTLS         0x00080000
+#define CLONE_PARENT_SETTID  0x00100000
+#define CLONE_CHILD_CLEARTID 0x00200000
+#define CLONE_DETACHED       0x00400000
+#define CSIGNAL              0x000000ff /* Signal sent to the parent on exit */
+
+/* Status of an exited process as wait4 reports it, as in Linux. */
+#define EXIT_STATUS(code) (((code) & 0xff) << 8) /* exit(code) */
+#define KILL_STATUS(sig)  ((sig) & 0x7f)         /* Ended by signal sig */
+#define SIGKILL           9
+#define SIGSEGV           11
+
+#define WNOHANG 1 /* Option of wait: don't wait if no child has exited */
+
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+struct scheduler;
+
 /* Stack must always be 16 bytes aligned. */
 struct context {
     u64 lr0, lr, fp;
@@ -22,8 +50,7 @@ struct context {
 
 struct proc {
     // struct sched_obj sched;
-    u64 sz;                  /* Size of process memory (bytes)          */
-    u64 *pgdir;              /* Page table                              */
+    struct mm *mm;           /* User address space                      */
     char *kstack;            /* Bottom of kernel stack for this process */
     enum procstate state;    /* Process state                           */
     int pid;                 /* Process ID                              */
@@ -35,10 +62,70 @@ struct proc {
     char name[16];           /* Process name (debugging)                */
     void *cont;
     bool is_scheduler;
+    struct scheduler *scheduler; /* Scheduler owning this process */
+    ListNode ptable_node;        /* Link in the processes of that scheduler */
+    ListNode pid_node;           /* Link in its pid hash */
+    int pid_level;               /* Level of the pid namespace of scheduler */
+    /* pid in that namespace and in those above, by level, see pid.c. */
+    struct upid pids[PIDNS_LEVELS];
+    int cpu;                     /* Run queue of this process (percpu_op) */
+    ListNode rq_node;            /* Link in that run queue */
+    ListNode queued_node;        /* Link in the list of all it queues */
+    u64 cpus_allowed;            /* Bit i is set if it may run on CPU i */
+    u64 load_weight;             /* Weight in the load of its run queue */
+    u64 last_ran;                /* Timestamp when last switched out */
+    ListNode wait_node;          /* Link in the wait queue of chan */
+    u64 exec_start;              /* Timestamp when last switched in */
+
+    /* Fair scheduling (cfs_op). */
+    int nice;                   /* -20 (most favoured) ... 19 */
+    i64 vruntime;               /* Run time scaled by nice weight */
+    struct proc *heap_child[2]; /* Leftist heap links in the run queue */
+    struct proc *heap_parent;
+    int heap_rank;
+
+    /* Real-time scheduling (rt_op). */
+    int policy;      /* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+    int rt_priority; /* 1 ... 99 unless SCHED_OTHER */
+    bool preempted;  /* Switched out involuntarily */
+
+    /* Accounting, in ticks of the generic timer. */
+    u64 utime, stime;   /* Run in user and in kernel mode */
+    u64 wtime;          /* RUNNABLE, waiting for a CPU */
+    u64 cutime, cstime; /* utime and stime of reaped children */
+    u64 acct_stamp;     /* Start of the time not charged yet */
+    u64 nvcsw, nivcsw;  /* Voluntary and involuntary switches */
+
+    /* FP/SIMD registers, switched lazily (fpsimd.c). */
+    FpsimdState *fpsimd; /* Saved state, NULL until first used */
+    int fpsimd_cpu;      /* CPU whose registers hold its state too, -1 if none */
+    bool fpsimd_dirty;   /* Those registers may be newer than fpsimd */
+
+    /*
+     * Threads (CLONE_THREAD) of a process form a group, led by the first
+     * one. They share the open files and current directory of the leader,
+     * which stays a zombie until all of them have exited.
+     */
+    struct proc *group_leader; /* Itself if not a thread */
+    int nr_threads;            /* Live threads of the group, in the leader */
+    int *clear_child_tid;      /* Cleared when exiting, see set_tid_address */
+    ListNode threads;          /* The other threads, in the leader */
+    ListNode thread_node;      /* Link in the threads of the leader */
+
+    /*
+     * Children of a group are kept by its leader, and are leaders too. A
+     * child whose threads have all exited is also queued on zombies, until
+     * wait frees it. Orphans are handed to init.
+     */
+    ListNode children;     /* Children, linked by sibling_node */
+    ListNode sibling_node; /* Link in the children of the parent */
+    ListNode zombies;      /* Exited children, linked by zombie_node */
+    ListNode zombie_node;  /* Link in the zombies of the parent */
+    int exit_status;       /* Reported by wait, in the leader */
+    bool group_exit;       /* exit_group set exit_status, in the leader */
 
-    struct file *ofile[NOFILE]; /* Open files */
-    Inode *cwd;                 /* Current directory */
-    u64 stksz, base;
+    FdTable fdtable; /* Open files, used through the group leader */
+    Inode *cwd;      /* Current directory, likewise */
 };
 
 typedef struct proc proc;
@@ -46,10 +133,15 @@ typedef struct proc proc;
 void init_proc();
 void spawn_init_process();
 void yield();
-NO_RETURN void exit();
+void preempt();
+NO_RETURN void exit(int status);
 void sleep(void *chan, SpinLock *lock);
 void wakeup(void *chan);
-void idle_init();
+void wakeup_one(void *chan);
 int growproc(int n);
-int wait();
+int wait(int pid, int options, int *status, u64 *utime, u64 *stime);
 int fork();
+int clone(int flags, u64 stack, int *ptid, u64 tls, int *ctid);
+NO_RETURN void exit_group(int status);
+void kill_other_threads();
+struct proc *find_proc(int pid);
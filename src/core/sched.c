@@ -1,30 +1,139 @@
 #include <common/defines.h>
+#include <common/string.h>
+#include <core/arena.h>
 #include <core/console.h>
 #include <core/container.h>
+#include <core/fpsimd.h>
+#include <core/physical_memory.h>
 #include <core/sched.h>
+#include <core/timer.h>
 #include <core/virtual_memory.h>
+#include <driver/interrupt.h>
 
 #ifdef MULTI_SCHEDULER
 
 struct cpu cpus[NCPU];
+/* procs are allocated as needed, the ptable only links them. */
+static Arena pcb_arena;
 static void scheduler_simple(struct scheduler *this);
+static struct proc *pick_next_simple(struct scheduler *this);
+static void put_back_simple(struct scheduler *this, struct proc *p);
 static struct proc *alloc_pcb_simple(struct scheduler *this);
 static void sched_simple(struct scheduler *this);
 static void init_sched_simple(struct scheduler *this);
 static void acquire_ptable_lock(struct scheduler *this);
 static void release_ptable_lock(struct scheduler *this);
+static SpinLock *get_ptable_lock(struct scheduler *this, struct proc *p);
+static void activate_simple(struct scheduler *this, struct proc *p);
+static u64 slice_fixed(struct runqueue *rq, struct proc *p);
 struct sched_op simple_op = {.scheduler = scheduler_simple,
+                             .pick_next = pick_next_simple,
+                             .put_back = put_back_simple,
                              .alloc_pcb = alloc_pcb_simple,
                              .sched = sched_simple,
                              .init = init_sched_simple,
                              .acquire_lock = acquire_ptable_lock,
-                             .release_lock = release_ptable_lock};
+                             .release_lock = release_ptable_lock,
+                             .get_lock = get_ptable_lock,
+                             .activate = activate_simple,
+                             .slice = slice_fixed};
 struct scheduler simple_scheduler = {.op = &simple_op};
 
+static void scheduler_percpu(struct scheduler *this);
+static struct proc *pick_next_percpu(struct scheduler *this);
+static void put_back_percpu(struct scheduler *this, struct proc *p);
+static struct proc *alloc_pcb_percpu(struct scheduler *this);
+static void sched_percpu(struct scheduler *this);
+static void init_sched_percpu(struct scheduler *this);
+static void acquire_rq_lock(struct scheduler *this);
+static void release_rq_lock(struct scheduler *this);
+static SpinLock *get_rq_lock(struct scheduler *this, struct proc *p);
+static void activate_percpu(struct scheduler *this, struct proc *p);
+static void enqueue_fifo(struct runqueue *rq, struct proc *p, int flags);
+static struct proc *pick_fifo(struct runqueue *rq, int flags);
+static void dequeue_fifo(struct runqueue *rq, struct proc *p, int flags);
+static void put_prev_fifo(struct runqueue *rq, struct proc *p);
+struct sched_op percpu_op = {.scheduler = scheduler_percpu,
+                             .pick_next = pick_next_percpu,
+                             .put_back = put_back_percpu,
+                             .alloc_pcb = alloc_pcb_percpu,
+                             .sched = sched_percpu,
+                             .init = init_sched_percpu,
+                             .acquire_lock = acquire_rq_lock,
+                             .release_lock = release_rq_lock,
+                             .get_lock = get_rq_lock,
+                             .activate = activate_percpu,
+                             .enqueue = enqueue_fifo,
+                             .pick = pick_fifo,
+                             .dequeue = dequeue_fifo,
+                             .put_prev = put_prev_fifo,
+                             .slice = slice_fixed};
+
+static void enqueue_fair(struct runqueue *rq, struct proc *p, int flags);
+static struct proc *pick_fair(struct runqueue *rq, int flags);
+static void dequeue_fair(struct runqueue *rq, struct proc *p, int flags);
+static void put_prev_fair(struct runqueue *rq, struct proc *p);
+static u64 slice_fair(struct runqueue *rq, struct proc *p);
+static u64 _load_weight(struct proc *p);
+struct sched_op cfs_op = {.scheduler = scheduler_percpu,
+                          .pick_next = pick_next_percpu,
+                          .put_back = put_back_percpu,
+                          .alloc_pcb = alloc_pcb_percpu,
+                          .sched = sched_percpu,
+                          .init = init_sched_percpu,
+                          .acquire_lock = acquire_rq_lock,
+                          .release_lock = release_rq_lock,
+                          .get_lock = get_rq_lock,
+                          .activate = activate_percpu,
+                          .enqueue = enqueue_fair,
+                          .pick = pick_fair,
+                          .dequeue = dequeue_fair,
+                          .put_prev = put_prev_fair,
+                          .slice = slice_fair};
+
+static void init_sched_rt(struct scheduler *this);
+static void activate_rt(struct scheduler *this, struct proc *p);
+static void enqueue_rt(struct runqueue *rq, struct proc *p, int flags);
+static struct proc *pick_rt(struct runqueue *rq, int flags);
+static void dequeue_rt(struct runqueue *rq, struct proc *p, int flags);
+static void put_prev_rt(struct runqueue *rq, struct proc *p);
+static u64 slice_rt(struct runqueue *rq, struct proc *p);
+struct sched_op rt_op = {.scheduler = scheduler_percpu,
+                         .pick_next = pick_next_percpu,
+                         .put_back = put_back_percpu,
+                         .alloc_pcb = alloc_pcb_percpu,
+                         .sched = sched_percpu,
+                         .init = init_sched_rt,
+                         .acquire_lock = acquire_rq_lock,
+                         .release_lock = release_rq_lock,
+                         .get_lock = get_rq_lock,
+                         .activate = activate_rt,
+                         .enqueue = enqueue_rt,
+                         .pick = pick_rt,
+                         .dequeue = dequeue_rt,
+                         .put_prev = put_prev_rt,
+                         .slice = slice_rt};
+
 void swtch(struct context **, struct context *);
 
-static void init_sched_simple(struct scheduler *this) {
+void init_sched() {
+    ArenaPageAllocator allocator = {.allocate = kalloc, .free = kfree};
+    init_arena(&pcb_arena, sizeof(struct proc), allocator);
+}
+
+static void _init_ptable(struct scheduler *this) {
     init_spinlock(&this->ptable.lock, "ptable");
+    init_list_node(&this->ptable.procs);
+    for (int i = 0; i < NPIDHASH; i++)
+        init_list_node(&this->ptable.pid_hash[i]);
+}
+
+static INLINE ListNode *_pid_bucket(struct scheduler *this, int pid) {
+    return &this->ptable.pid_hash[(u32)pid % NPIDHASH];
+}
+
+static void init_sched_simple(struct scheduler *this) {
+    _init_ptable(this);
 }
 
 static void acquire_ptable_lock(struct scheduler *this) {
@@ -35,69 +144,288 @@ static void release_ptable_lock(struct scheduler *this) {
     release_spinlock(&this->ptable.lock);
 }
 
-static inline struct context *get_context(struct proc *p) {
-    return p->is_scheduler ? ((struct container *)p->cont)->scheduler.context[cpuid()] : p->context;
+static SpinLock *get_ptable_lock(struct scheduler *this, struct proc *p) {
+    (void)p;
+    return &this->ptable.lock;
+}
+
+/*
+ * A process of this just became RUNNABLE. The process of its container
+ * sleeps while the container has nothing to run, see _run, so make it
+ * RUNNABLE in the parent as well, and so on up. If it is RUNNING, it may
+ * have found nothing just before, so it is told to stay RUNNABLE. Must
+ * hold the scheduler lock of the process, which is taken before that of
+ * the parent.
+ */
+static void _wake_container(struct scheduler *this) {
+    for (struct container *c = this->cont; c != root_container && c->p != NULL;
+         c = c->parent) {
+        struct scheduler *parent = c->scheduler.parent;
+        struct proc *p = c->p;
+        SpinLock *lock = parent->op->get_lock(parent, p);
+        bool held = holding_spinlock(lock), woken = false;
+        if (!held)
+            acquire_spinlock(lock);
+        if (p->state == RUNNING) {
+            c->woken = true;
+        } else if (p->state == SLEEPING) {
+            acquire_spinlock(&c->lock);
+            woken = !c->cpu.throttled; /* _unthrottle will wake it */
+            release_spinlock(&c->lock);
+            if (woken)
+                parent->op->activate(parent, p);
+        }
+        if (!held)
+            release_spinlock(lock);
+        /* Any further up is RUNNABLE or RUNNING already. */
+        if (!woken)
+            break;
+    }
+}
+
+static void activate_simple(struct scheduler *this, struct proc *p) {
+    p->state = RUNNABLE;
+    p->acct_stamp = get_timestamp();
+    _wake_container(this);
+}
+
+/* Charge the time since p->acct_stamp to *counter, and restart from now. */
+void account_time(struct proc *p, u64 *counter) {
+    u64 now = get_timestamp();
+    *counter += now - p->acct_stamp;
+    p->acct_stamp = now;
 }
 
-static inline struct context **get_context_address(struct proc *p) {
-    return p->is_scheduler ? &((struct container *)p->cont)->scheduler.context[cpuid()]
-                           : &p->context;
+static u64 slice_fixed(struct runqueue *rq, struct proc *p) {
+    (void)rq;
+    (void)p;
+    return SLICE_US * 1000;
 }
 
-void yield_scheduler(struct scheduler *this) {
-    if (this == &root_container->scheduler)
+/*
+ * Containers share the CPU by the weight and quota of their processes in
+ * the scheduler of the parent, see struct cpu_bandwidth. The run time of
+ * such a process is charged to its container whenever it is switched
+ * out, and the slice of a process in a container with a quota is cut
+ * short where that, or a container around it, would run out.
+ */
+/* Start a new period if the current one is over. Must hold the container lock. */
+static void _roll_period(struct cpu_bandwidth *cpu, u64 now) {
+    if (now - cpu->period_start < cpu->period)
         return;
-    acquire_ptable_lock(this->parent);
-    thiscpu()->proc->state = RUNNABLE;
-    thiscpu()->scheduler = this->parent;
-    assert(holding_spinlock(&this->ptable.lock));
+    cpu->period_start = now - (now - cpu->period_start) % cpu->period;
+    if (cpu->period_used != 0)
+        cpu->nr_periods++;
+    cpu->period_used = 0;
+}
 
-    release_ptable_lock(this);
-    // swtch(get_context_address(this), get_context(this->parent));
-    sched_simple(this->parent);
-    acquire_ptable_lock(this);
-    release_ptable_lock(this->parent);
-    thiscpu()->scheduler = this;
+/* End of a throttled period: make the process of the container RUNNABLE again. */
+static void _unthrottle(Timer *timer) {
+    struct container *c = container_of(timer, struct container, cpu.unthrottle);
+    struct scheduler *parent = c->scheduler.parent;
+    struct proc *p = c->p;
+    SpinLock *lock = parent->op->get_lock(parent, p);
+    acquire_spinlock(lock);
+    acquire_spinlock(&c->lock);
+    u64 now = get_timestamp();
+    c->cpu.throttled = false;
+    c->cpu.throttled_time += now - c->cpu.throttled_at;
+    _roll_period(&c->cpu, now);
+    release_spinlock(&c->lock);
+    if (p->state == SLEEPING)
+        parent->op->activate(parent, p);
+    release_spinlock(lock);
+}
+
+void init_container_cpu(struct container *c) {
+    c->cpu.shares = CPU_SHARES_DEFAULT;
+    c->cpu.quota = 0;
+    c->cpu.period = ns_to_ticks(CPU_PERIOD_DEFAULT_US * 1000);
+    init_timer(&c->cpu.unthrottle, _unthrottle);
+}
+
+/*
+ * Charge the run that just ended to the container of p, a container
+ * process, and throttle it if that used up its quota. Must hold the
+ * scheduler lock of p.
+ */
+static void _charge_container(struct proc *p) {
+    struct container *c = p->cont;
+    u64 now = p->acct_stamp, ran = now - p->exec_start;
+    acquire_spinlock(&c->lock);
+    c->cpu.usage += ran;
+    if (c->cpu.quota != 0) {
+        _roll_period(&c->cpu, now);
+        c->cpu.period_used += ran;
+        if (c->cpu.period_used >= c->cpu.quota && p->state == RUNNABLE &&
+            timer_add(&c->cpu.unthrottle, c->cpu.period_start + c->cpu.period) == 0) {
+            /* Not on any queue until _unthrottle, nor woken by anything else. */
+            p->state = SLEEPING;
+            c->cpu.throttled = true;
+            c->cpu.throttled_at = now;
+            c->cpu.nr_throttled++;
+        }
+    }
+    release_spinlock(&c->lock);
+}
+
+/*
+ * The slice of a process in this, cut short where a container around it
+ * would use up its quota. The processes of those containers are running
+ * on this CPU, since their exec_start.
+ */
+static u64 _cap_slice(struct scheduler *this, u64 slice) {
+    u64 now = get_timestamp();
+    for (struct container *c = this->cont; c != root_container; c = c->parent) {
+        u64 quota = c->cpu.quota, used = c->cpu.period_used + now - c->p->exec_start;
+        if (quota == 0 || now - c->cpu.period_start >= c->cpu.period)
+            continue;
+        u64 left = ticks_to_ns(used < quota ? quota - used : 0);
+        if (slice == 0 || left < slice)
+            slice = MAX(left, 1ull);
+    }
+    return slice;
+}
+
+/*
+ * Set the weight of c and its quota per period, 0 meaning no limit.
+ * Returns -1 if one is out of range.
+ */
+int set_container_cpu(struct container *c, u64 shares, u64 quota_us, u64 period_us) {
+    if (c == root_container || shares < CPU_SHARES_MIN || shares > CPU_SHARES_MAX ||
+        period_us < CPU_PERIOD_MIN_US || period_us > CPU_PERIOD_MAX_US ||
+        (quota_us != 0 && quota_us < CPU_PERIOD_MIN_US))
+        return -1;
+    acquire_spinlock(&c->lock);
+    c->cpu.shares = shares;
+    c->cpu.quota = ns_to_ticks(quota_us * 1000);
+    c->cpu.period = ns_to_ticks(period_us * 1000);
+    c->cpu.period_start = get_timestamp();
+    c->cpu.period_used = 0;
+    release_spinlock(&c->lock);
+    return 0;
+}
+
+void get_container_cpu_stat(struct container *c, struct cpu_stat *st) {
+    acquire_spinlock(&c->lock);
+    st->usage_us = ticks_to_ns(c->cpu.usage) / 1000;
+    st->nr_periods = c->cpu.nr_periods;
+    st->nr_throttled = c->cpu.nr_throttled;
+    st->throttled_us = ticks_to_ns(c->cpu.throttled_time) / 1000;
+    st->shares = c->cpu.shares;
+    st->quota_us = ticks_to_ns(c->cpu.quota) / 1000;
+    st->period_us = ticks_to_ns(c->cpu.period) / 1000;
+    release_spinlock(&c->lock);
+}
+
+/* The queue of this CPU, or NULL for a scheduler without run queues. */
+static INLINE struct runqueue *_local_rq(struct scheduler *this) {
+    return this->op->pick != NULL ? &this->rq[cpuid()] : NULL;
+}
+
+/*
+ * Make p RUNNING and account the switch to it. For a process that really
+ * runs, not that of a container, also start the tick for its slice.
+ */
+static void _switch_in(struct scheduler *this, struct proc *p) {
+    p->state = RUNNING;
+    account_time(p, &p->wtime);
+    p->exec_start = p->acct_stamp;
+    if (p->is_scheduler)
+        return;
+    thiscpu()->need_resched = false;
+    start_tick(_cap_slice(this, this->op->slice(_local_rq(this), p)));
+    fpsimd_switch_in(p);
+}
+
+/* Account the switch away from p, which is back from swtch. */
+static void _switch_out(struct proc *p) {
+    account_time(p, &p->stime);
+    p->last_ran = p->acct_stamp;
+    if (p->preempted)
+        p->nivcsw++;
+    else
+        p->nvcsw++;
+    if (p->is_scheduler)
+        _charge_container(p);
+}
+
+/* Where every process switches back to when it gives up the CPU. */
+static INLINE struct context **_dispatcher() {
+    return &root_container->scheduler.context[cpuid()];
+}
+
+/*
+ * Containers are scheduled flat. Only the scheduler of the root container
+ * loops on each CPU. The process of a container it picks is never switched
+ * to: the scheduler of the container picks in its place, and so on down
+ * to a process that really runs, which the loop switches to directly. That
+ * process switches straight back, see _dispatcher, and then each level
+ * charges the run to the process it picked and queues it again, unless
+ * its container had nothing to run. A level is locked only while it picks
+ * and puts back, so the loop never locks two schedulers together, and a
+ * process holds the lock of its own scheduler across swtch as before.
+ *
+ * Run p, just picked by this, on this CPU. Must hold the CPU lock of this,
+ * which is held again once p has given up the CPU.
+ */
+static void _run(struct scheduler *this, struct proc *p) {
+    _switch_in(this, p);
+    if (p->is_scheduler) {
+        struct scheduler *child = &((struct container *)p->cont)->scheduler;
+        struct proc *next;
+        this->op->release_lock(this);
+        thiscpu()->scheduler = child;
+        thiscpu()->proc = p;
+        child->op->acquire_lock(child);
+        if ((next = child->op->pick_next(child)) != NULL)
+            _run(child, next);
+        child->op->release_lock(child);
+        thiscpu()->scheduler = this;
+        this->op->acquire_lock(this);
+        /* An empty container sleeps until _wake_container. */
+        p->state = next != NULL || child->cont->woken ? RUNNABLE : SLEEPING;
+        child->cont->woken = false;
+    } else {
+        uvm_switch(p->mm->pgdir);
+        thiscpu()->proc = p;
+        swtch(_dispatcher(), p->context);
+    }
+    _switch_out(p);
+    this->op->put_back(this, p);
+    p->preempted = false;
+    thiscpu()->proc = this->cont->p;
+}
+
+static INLINE bool _allowed(struct proc *p, int cpu) {
+    return p->cpus_allowed >> cpu & 1;
+}
+
+/* The first RUNNABLE process, for round robin. */
+static struct proc *pick_next_simple(struct scheduler *this) {
+    for (ListNode *node = this->ptable.procs.next; node != &this->ptable.procs;
+         node = node->next) {
+        struct proc *p = container_of(node, struct proc, ptable_node);
+        if (p->state == RUNNABLE && _allowed(p, (int)cpuid()))
+            return p;
+    }
+    return NULL;
+}
+
+/* Move p to the back. */
+static void put_back_simple(struct scheduler *this, struct proc *p) {
+    detach_from_list(&p->ptable_node);
+    merge_list(this->ptable.procs.prev, &p->ptable_node);
 }
 
 NO_RETURN void scheduler_simple(struct scheduler *this) {
     struct proc *p;
-    // struct cpu *c = thiscpu();
-    // c->proc = NULL;
-    assert(thiscpu()->scheduler == this);
-    assert(thiscpu()->proc == this->cont->p || this == &root_container->scheduler);
+    assert(this == &root_container->scheduler);
 
     for (;;) {
-        /* Loop over process table looking for process to run. */
-        /* TODO: Your code here. */
         acquire_ptable_lock(this);
-        for (p = this->ptable.proc; p < this->ptable.proc + NPROC; p++) {
-            if (p->state == RUNNABLE) {
-                uvm_switch(p->pgdir);
-                thiscpu()->proc = p;
-                p->state = RUNNING;
-                assert(this == thiscpu()->scheduler);
-                swtch(&this->context[cpuid()], get_context(p));
-                if (p->is_scheduler) {
-                    // release_ptable_lock(&((struct container *)p->cont)->scheduler);
-                }
-                thiscpu()->proc = this->cont->p;
-                thiscpu()->scheduler = this;
-                assert(thiscpu()->scheduler == this);
-                assert(thiscpu()->proc == this->cont->p || this == &root_container->scheduler);
-                assert(holding_spinlock(&this->ptable.lock));
-                yield_scheduler(this);
-                assert(thiscpu()->scheduler == this);
-                assert(thiscpu()->proc == this->cont->p || this == &root_container->scheduler);
-                assert(holding_spinlock(&this->ptable.lock));
-                // back
-                // c->proc = NULL;
-            }
-        }
-        assert(thiscpu()->scheduler == this);
-        assert(thiscpu()->proc == this->cont->p || this == &root_container->scheduler);
-        assert(holding_spinlock(&this->ptable.lock));
-        yield_scheduler(this);
+        if ((p = pick_next_simple(this)) != NULL)
+            _run(this, p);
         release_ptable_lock(this);
     }
 }
@@ -113,29 +441,692 @@ static void sched_simple(struct scheduler *this) {
     if (thiscpu()->proc->state == RUNNING) {
         PANIC("sched: process running");
     }
-    swtch(get_context_address(thiscpu()->proc), this->context[cpuid()]);
+    swtch(&thiscpu()->proc->context, *_dispatcher());
 }
 
 static struct proc *alloc_pcb_simple(struct scheduler *this) {
-    struct proc *p;
-    acquire_ptable_lock(this);
-    int found = 0;
-    for (p = this->ptable.proc; p < this->ptable.proc + NPROC; p++) {
-        if (p->state == UNUSED) {
-            found = 1;
-            break;
-        }
-    }
-    if (found == 0) {
-        release_ptable_lock(this);
+    struct proc *p = alloc_object(&pcb_arena);
+    if (p == NULL)
+        return NULL;
+    memset(p, 0, sizeof(*p));
+    if (alloc_resource(this->cont, p, PID) == (void *)-1) {
+        free_object(p);
         return NULL;
     }
-    alloc_resource(this->cont, p, PID);
-    p->pid = this->pid;
+    acquire_ptable_lock(this);
+    p->scheduler = this;
+    init_list_node(&p->wait_node);
+    p->cpus_allowed = CPU_MASK_ALL;
+    p->fpsimd_cpu = -1;
+    p->group_leader = p;
+    p->nr_threads = 1;
+    init_list_node(&p->threads);
+    init_list_node(&p->thread_node);
+    init_list_node(&p->children);
+    init_list_node(&p->sibling_node);
+    init_list_node(&p->zombies);
+    init_list_node(&p->zombie_node);
+    init_list_node(&p->ptable_node);
+    merge_list(this->ptable.procs.prev, &p->ptable_node);
+    init_list_node(&p->pid_node);
+    merge_list(_pid_bucket(this, p->pid), &p->pid_node);
+    p->nice = 0;
     p->state = EMBRYO;
     release_ptable_lock(this);
 
     return p;
 }
 
+/*
+ * Take p off the ptable and free it. Must hold the ptable lock, and p must
+ * not be on any queue, nor have threads or children linked to it.
+ */
+void free_pcb(struct scheduler *this, struct proc *p) {
+    (void)this;
+    detach_from_list(&p->ptable_node);
+    detach_from_list(&p->pid_node);
+    detach_from_list(&p->thread_node);
+    detach_from_list(&p->sibling_node);
+    detach_from_list(&p->zombie_node);
+    free_pid(p);
+    fpsimd_free(p);
+    free_object(p);
+}
+
+/* Find the process with pid. Must hold the ptable lock. */
+struct proc *lookup_pcb(struct scheduler *this, int pid) {
+    ListNode *head = _pid_bucket(this, pid);
+    for (ListNode *node = head->next; node != head; node = node->next) {
+        struct proc *p = container_of(node, struct proc, pid_node);
+        if (p->pid == pid)
+            return p;
+    }
+    return NULL;
+}
+
+/*
+ * percpu_op keeps RUNNABLE processes on per-CPU run queues instead of
+ * scanning the ptable. Each queue has its own lock, which is the scheduler
+ * lock of that CPU. An idle CPU steals from the busiest queue. ptable.lock
+ * only guards the process list and parent/child links, and is always taken
+ * before any run queue lock. The order within a queue is left to the
+ * enqueue/pick/dequeue ops: percpu_op runs a FIFO, cfs_op a fair queue.
+ *
+ * A process runs only on the CPUs in its cpus_allowed, and otherwise stays
+ * on the CPU it last ran on: it is woken there, and only load balancing
+ * moves it. A process queued on a CPU it may no longer run on is pushed
+ * to another one when that CPU next picks it.
+ *
+ * Balancing pulls: every BALANCE_MS, and whenever it runs out of work, a
+ * CPU takes processes from the queue with the highest load until the two
+ * are even. The load of a queue is the sum of the nice weights of its
+ * processes, the running one included. Moving a cache-hot process costs
+ * more than the imbalance is worth, so one that ran in the last
+ * CACHE_HOT_US is only taken by an idle CPU with no other choice, or
+ * after BALANCE_HOT_TRIES passes failed to move anything else.
+ */
+static void init_sched_percpu(struct scheduler *this) {
+    _init_ptable(this);
+    for (int i = 0; i < NCPU; i++) {
+        init_spinlock(&this->rq[i].lock, "runqueue");
+        this->rq[i].nr = 0;
+        init_list_node(&this->rq[i].queued);
+        this->rq[i].load = this->rq[i].curr_load = 0;
+        this->rq[i].next_balance = 0;
+        this->rq[i].balance_failed = 0;
+        memset(&this->rq[i].stat, 0, sizeof(this->rq[i].stat));
+        init_list_node(&this->rq[i].head);
+        this->rq[i].heap = NULL;
+        this->rq[i].min_vruntime = 0;
+    }
+}
+
+static void acquire_rq_lock(struct scheduler *this) {
+    acquire_spinlock(&this->rq[cpuid()].lock);
+}
+
+static void release_rq_lock(struct scheduler *this) {
+    release_spinlock(&this->rq[cpuid()].lock);
+}
+
+static SpinLock *get_rq_lock(struct scheduler *this, struct proc *p) {
+    return &this->rq[p == NULL ? (int)cpuid() : p->cpu].lock;
+}
+
+/* Queue p on rq. Must hold its lock. */
+static void _enqueue(struct scheduler *this, struct runqueue *rq, struct proc *p, int flags) {
+    this->op->enqueue(rq, p, flags);
+    merge_list(rq->queued.prev, &p->queued_node);
+    p->load_weight = _load_weight(p);
+    rq->load += p->load_weight;
+}
+
+static struct proc *_pick(struct scheduler *this, struct runqueue *rq, int flags) {
+    struct proc *p = this->op->pick(rq, flags);
+    detach_from_list(&p->queued_node);
+    rq->load -= p->load_weight;
+    return p;
+}
+
+static void _dequeue(struct scheduler *this, struct runqueue *rq, struct proc *p, int flags) {
+    this->op->dequeue(rq, p, flags);
+    detach_from_list(&p->queued_node);
+    rq->load -= p->load_weight;
+}
+
+/*
+ * Lock the queue of CPU other too, taking both locks in CPU order. The
+ * local lock may be dropped meanwhile.
+ */
+static void _double_lock(struct scheduler *this, int other) {
+    int self = (int)cpuid();
+    if (other < self) {
+        release_spinlock(&this->rq[self].lock);
+        acquire_spinlock(&this->rq[other].lock);
+        acquire_spinlock(&this->rq[self].lock);
+    } else {
+        acquire_spinlock(&this->rq[other].lock);
+    }
+}
+
+/*
+ * Interrupt an idle CPU for p, queued on p->cpu: that CPU itself if it
+ * idles, or else another one that may steal it.
+ */
+static void _kick_idle(struct proc *p) {
+    int cpu = p->cpu;
+    if (!cpus[cpu].idle) {
+        for (int i = 0; i < NCPU; i++) {
+            if (i != (int)cpuid() && cpus[i].idle && _allowed(p, i)) {
+                cpu = i;
+                break;
+            }
+        }
+    }
+    if (cpus[cpu].idle && cpu != (int)cpuid())
+        send_ipi((usize)cpu);
+}
+
+static void activate_percpu(struct scheduler *this, struct proc *p) {
+    p->state = RUNNABLE;
+    p->acct_stamp = get_timestamp();
+    _enqueue(this, &this->rq[p->cpu], p, RQ_WAKEUP);
+    _kick_idle(p);
+    _wake_container(this);
+}
+
+/* The CPU with the shortest queue among those p may run on. */
+static int _select_cpu(struct scheduler *this, struct proc *p) {
+    int best = -1;
+    for (int i = 0; i < NCPU; i++) {
+        if (_allowed(p, i) && (best < 0 || this->rq[i].nr < this->rq[best].nr))
+            best = i;
+    }
+    return best;
+}
+
+/*
+ * Move p, queued here but not allowed to run here, to a CPU it may run
+ * on. Must hold the local queue lock, which may be dropped meanwhile.
+ */
+static void _push(struct scheduler *this, struct proc *p) {
+    int self = (int)cpuid(), target = _select_cpu(this, p);
+    _double_lock(this, target);
+    /* Another CPU may have stolen it while the lock was dropped. */
+    if (p->cpu == self) {
+        fpsimd_flush(p);
+        _dequeue(this, &this->rq[self], p, RQ_MIGRATE);
+        p->cpu = target;
+        _enqueue(this, &this->rq[target], p, RQ_MIGRATE);
+        _kick_idle(p);
+    }
+    release_spinlock(&this->rq[target].lock);
+}
+
+/*
+ * Lock the run state of p, and so keep it on its CPU. Returns NULL if the
+ * caller holds that lock already, as the ptable lock of simple_op.
+ */
+static SpinLock *_lock_proc(struct scheduler *s, struct proc *p) {
+    for (;;) {
+        SpinLock *lock = s->op->get_lock(s, p);
+        if (holding_spinlock(lock))
+            return NULL;
+        acquire_spinlock(lock);
+        /* p may have been stolen meanwhile. */
+        if (lock == s->op->get_lock(s, p))
+            return lock;
+        release_spinlock(lock);
+    }
+}
+
+/*
+ * Restrict p to the CPUs in mask, which must not be empty. Must hold the
+ * ptable lock. If p runs on a CPU it may no longer use, that CPU is asked
+ * to switch away from it, and then pushes it on.
+ */
+void set_cpus_allowed(struct proc *p, u64 mask) {
+    struct scheduler *s = p->scheduler;
+    SpinLock *lock = _lock_proc(s, p);
+    p->cpus_allowed = mask;
+    if (s->op->dequeue != NULL && !_allowed(p, p->cpu) && cpus[p->cpu].proc == p) {
+        cpus[p->cpu].need_resched = true;
+        if (p->cpu != (int)cpuid())
+            send_ipi((usize)p->cpu);
+    }
+    if (lock != NULL)
+        release_spinlock(lock);
+}
+
+/*
+ * Change the policy of p. Must hold the ptable lock. A queued p is queued
+ * again, since the policy may decide which queue it is on.
+ */
+void set_sched_policy(struct proc *p, int policy, int prio) {
+    struct scheduler *s = p->scheduler;
+    SpinLock *lock = _lock_proc(s, p);
+    bool requeue = s->op->dequeue != NULL && p->state == RUNNABLE;
+    if (requeue)
+        _dequeue(s, &s->rq[p->cpu], p, 0);
+    p->policy = policy;
+    p->rt_priority = prio;
+    if (requeue)
+        _enqueue(s, &s->rq[p->cpu], p, 0);
+    if (lock != NULL)
+        release_spinlock(lock);
+}
+
+/*
+ * Wait for an interrupt with the tick stopped. Other timers stay armed.
+ * Must hold the queue lock, which is dropped meanwhile. Interrupts stay
+ * masked in the kernel, so whatever woke us is dispatched by hand: an IPI
+ * from a waker, or a device interrupt routed to this CPU.
+ */
+static void _idle(struct runqueue *rq) {
+    thiscpu()->idle = true;
+    release_spinlock(&rq->lock);
+    stop_tick();
+    arch_wfi();
+    interrupt_global_handler();
+    thiscpu()->idle = false;
+    acquire_spinlock(&rq->lock);
+}
+
+static void enqueue_fifo(struct runqueue *rq, struct proc *p, int flags) {
+    (void)flags;
+    merge_list(rq->head.prev, &p->rq_node);
+    rq->nr++;
+}
+
+static struct proc *pick_fifo(struct runqueue *rq, int flags) {
+    struct proc *p = container_of(rq->head.next, struct proc, rq_node);
+    (void)flags;
+    detach_from_list(&p->rq_node);
+    rq->nr--;
+    return p;
+}
+
+static void dequeue_fifo(struct runqueue *rq, struct proc *p, int flags) {
+    (void)flags;
+    detach_from_list(&p->rq_node);
+    rq->nr--;
+}
+
+static void put_prev_fifo(struct runqueue *rq, struct proc *p) {
+    (void)rq;
+    (void)p;
+}
+
+static INLINE u64 _rq_load(struct runqueue *rq) {
+    return rq->load + rq->curr_load;
+}
+
+/*
+ * Move processes from src, locked, to the local queue until the imbalance
+ * is made up. Returns the number moved.
+ */
+static int _pull_from(struct scheduler *this, struct runqueue *src, u64 imbalance, bool hot) {
+    int self = (int)cpuid(), moved = 0;
+    struct runqueue *rq = &this->rq[self];
+    u64 hot_since = get_timestamp() - ns_to_ticks(CACHE_HOT_US * 1000ull);
+
+    for (ListNode *node = src->queued.next; node != &src->queued && imbalance > 0;) {
+        struct proc *p = container_of(node, struct proc, queued_node);
+        node = node->next;
+        /* Don't overshoot, unless this CPU has nothing to run at all. */
+        if (!_allowed(p, self) || (p->load_weight > imbalance && _rq_load(rq) > 0))
+            continue;
+        /* Its FP/SIMD registers are live on the other CPU only. */
+        if (__atomic_load_n(&p->fpsimd_dirty, __ATOMIC_ACQUIRE))
+            continue;
+        if (!hot && p->last_ran > hot_since) {
+            rq->stat.hot_skipped++;
+            continue;
+        }
+        _dequeue(this, src, p, RQ_MIGRATE);
+        p->cpu = self;
+        _enqueue(this, rq, p, RQ_MIGRATE);
+        imbalance -= MIN(imbalance, p->load_weight);
+        rq->stat.migrations++;
+        moved++;
+    }
+    return moved;
+}
+
+/*
+ * Even out the load of this CPU and the busiest one, as described above.
+ * idle tells that this CPU has nothing to run. Must hold the local queue
+ * lock, which may be dropped meanwhile.
+ */
+static void _balance(struct scheduler *this, bool idle) {
+    int self = (int)cpuid(), busiest = -1, moved = 0;
+    struct runqueue *rq = &this->rq[self], *src;
+    u64 max = 0;
+
+    rq->next_balance = get_timestamp() + ns_to_ticks(BALANCE_MS * 1000000ull);
+    rq->stat.balance++;
+    for (int i = 0; i < NCPU; i++) {
+        if (i != self && this->rq[i].nr > 0 && _rq_load(&this->rq[i]) > max) {
+            max = _rq_load(&this->rq[i]);
+            busiest = i;
+        }
+    }
+    if (busiest < 0 || max <= _rq_load(rq))
+        return;
+
+    src = &this->rq[busiest];
+    _double_lock(this, busiest);
+    /* The loads may have changed while the lock was dropped. */
+    if (_rq_load(src) > _rq_load(rq)) {
+        u64 imbalance = (_rq_load(src) - _rq_load(rq)) / 2;
+        moved = _pull_from(this, src, imbalance, rq->balance_failed >= BALANCE_HOT_TRIES);
+        if (moved == 0 && idle && rq->nr == 0)
+            moved = _pull_from(this, src, imbalance, true);
+        if (moved == 0) {
+            rq->balance_failed++;
+            rq->stat.balance_failed++;
+        } else {
+            rq->balance_failed = 0;
+        }
+    }
+    release_spinlock(&src->lock);
+}
+
+/* Pick the next process to run here, pushing on those not allowed here. */
+static struct proc *_pick_next(struct scheduler *this) {
+    struct runqueue *rq = &this->rq[cpuid()];
+    struct proc *p;
+    if (get_timestamp() >= rq->next_balance)
+        _balance(this, rq->nr == 0);
+    else if (rq->nr == 0)
+        _balance(this, true);
+    while ((p = rq->nr > 0 ? _pick(this, rq, 0) : NULL) != NULL &&
+           !_allowed(p, (int)cpuid())) {
+        _enqueue(this, rq, p, 0);
+        _push(this, p);
+    }
+    return p;
+}
+
+static struct proc *pick_next_percpu(struct scheduler *this) {
+    struct proc *p = _pick_next(this);
+    if (p != NULL)
+        this->rq[cpuid()].curr_load = p->load_weight;
+    return p;
+}
+
+static void put_back_percpu(struct scheduler *this, struct proc *p) {
+    struct runqueue *rq = &this->rq[cpuid()];
+    rq->curr_load = 0;
+    /*
+     * A process that gave up the CPU is queued only now that it is off
+     * its stack, or another CPU could steal it too early.
+     */
+    this->op->put_prev(rq, p);
+    if (p->state == RUNNABLE) {
+        _enqueue(this, rq, p, 0);
+        if (!_allowed(p, (int)cpuid()))
+            _push(this, p);
+        else
+            _kick_idle(p); /* to pull it or the next one */
+    }
+}
+
+NO_RETURN void scheduler_percpu(struct scheduler *this) {
+    struct runqueue *rq = &this->rq[cpuid()];
+    struct proc *p;
+    assert(this == &root_container->scheduler);
+
+    for (;;) {
+        acquire_spinlock(&rq->lock);
+        if ((p = pick_next_percpu(this)) != NULL)
+            _run(this, p);
+        else
+            _idle(rq);
+        release_spinlock(&rq->lock);
+    }
+}
+
+/*
+ * Enter scheduler.  Must hold only the run queue lock of this CPU.
+ */
+static void sched_percpu(struct scheduler *this) {
+    if (!holding_spinlock(&this->rq[cpuid()].lock)) {
+        PANIC("sched: not holding runqueue lock");
+    }
+    if (thiscpu()->proc->state == RUNNING) {
+        PANIC("sched: process running");
+    }
+    swtch(&thiscpu()->proc->context, *_dispatcher());
+}
+
+static struct proc *alloc_pcb_percpu(struct scheduler *this) {
+    struct proc *p = alloc_pcb_simple(this);
+    if (p != NULL) {
+        p->cpu = (int)cpuid();
+        init_list_node(&p->rq_node);
+        init_list_node(&p->queued_node);
+        /* A new process starts level with the others, neither ahead nor behind. */
+        p->vruntime = this->rq[p->cpu].min_vruntime;
+    }
+    return p;
+}
+
+/*
+ * cfs_op shares everything with percpu_op but the queue order. A process
+ * accumulates vruntime, its run time scaled down by its nice weight, and
+ * the one with the least vruntime runs next. A woken process gets at most
+ * CFS_SLEEPER_CREDIT_MS of credit, so it preempts CPU-bound ones soon
+ * without being able to bank a long sleep.
+ */
+#define CFS_SLEEPER_CREDIT_MS 3
+#define NICE_0_WEIGHT         1024
+
+/* Each nice level is worth about 10% of CPU time. */
+static const int nice_to_weight[40] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548,  7620,  6100,  4904,  3906,
+    /*  -5 */ 3121,  2501,  1991,  1586,  1277,
+    /*   0 */ 1024,  820,   655,   526,   423,
+    /*   5 */ 335,   272,   215,   172,   137,
+    /*  10 */ 110,   87,    70,    56,    45,
+    /*  15 */ 36,    29,    23,    18,    15,
+};
+
+static INLINE int _rank(struct proc *p) {
+    return p == NULL ? 0 : p->heap_rank;
+}
+
+/*
+ * Merge two leftist heaps. The right spines are logarithmic, and so is
+ * the recursion depth.
+ */
+static struct proc *_heap_merge(struct proc *a, struct proc *b) {
+    struct proc *t;
+    if (a == NULL)
+        return b;
+    if (b == NULL)
+        return a;
+    if (b->vruntime < a->vruntime) {
+        t = a;
+        a = b;
+        b = t;
+    }
+    a->heap_child[1] = _heap_merge(a->heap_child[1], b);
+    a->heap_child[1]->heap_parent = a;
+    if (_rank(a->heap_child[0]) < _rank(a->heap_child[1])) {
+        t = a->heap_child[0];
+        a->heap_child[0] = a->heap_child[1];
+        a->heap_child[1] = t;
+    }
+    a->heap_rank = _rank(a->heap_child[1]) + 1;
+    return a;
+}
+
+static void _heap_set_root(struct runqueue *rq, struct proc *root) {
+    rq->heap = root;
+    if (root != NULL)
+        root->heap_parent = NULL;
+}
+
+/*
+ * Take p out of the heap of rq, wherever it is. Ranks are fixed up the
+ * path to the root, as far as they change.
+ */
+static void _heap_delete(struct runqueue *rq, struct proc *p) {
+    struct proc *parent = p->heap_parent, *t;
+    struct proc *sub = _heap_merge(p->heap_child[0], p->heap_child[1]);
+    if (parent == NULL) {
+        _heap_set_root(rq, sub);
+        return;
+    }
+    parent->heap_child[parent->heap_child[1] == p] = sub;
+    if (sub != NULL)
+        sub->heap_parent = parent;
+    for (; parent != NULL; parent = parent->heap_parent) {
+        if (_rank(parent->heap_child[0]) < _rank(parent->heap_child[1])) {
+            t = parent->heap_child[0];
+            parent->heap_child[0] = parent->heap_child[1];
+            parent->heap_child[1] = t;
+        }
+        if (parent->heap_rank == _rank(parent->heap_child[1]) + 1)
+            break;
+        parent->heap_rank = _rank(parent->heap_child[1]) + 1;
+    }
+}
+
+static void enqueue_fair(struct runqueue *rq, struct proc *p, int flags) {
+    i64 credit = (i64)(get_clock_frequency() / 1000 * CFS_SLEEPER_CREDIT_MS);
+    if (flags & RQ_MIGRATE)
+        p->vruntime += rq->min_vruntime;
+    if (flags & (RQ_WAKEUP | RQ_MIGRATE))
+        p->vruntime = MAX(p->vruntime, rq->min_vruntime - credit);
+    p->heap_child[0] = p->heap_child[1] = NULL;
+    p->heap_rank = 1;
+    _heap_set_root(rq, _heap_merge(rq->heap, p));
+    rq->nr++;
+}
+
+static struct proc *pick_fair(struct runqueue *rq, int flags) {
+    struct proc *p = rq->heap;
+    _heap_set_root(rq, _heap_merge(p->heap_child[0], p->heap_child[1]));
+    rq->nr--;
+    rq->min_vruntime = MAX(rq->min_vruntime, p->vruntime);
+    /* Only the lag behind the old queue moves along. */
+    if (flags & RQ_MIGRATE)
+        p->vruntime -= rq->min_vruntime;
+    return p;
+}
+
+static void dequeue_fair(struct runqueue *rq, struct proc *p, int flags) {
+    _heap_delete(rq, p);
+    rq->nr--;
+    if (flags & RQ_MIGRATE)
+        p->vruntime -= rq->min_vruntime;
+}
+
+static void put_prev_fair(struct runqueue *rq, struct proc *p) {
+    u64 delta = get_timestamp() - p->exec_start;
+    (void)rq;
+    p->vruntime += (i64)(delta * NICE_0_WEIGHT / _load_weight(p));
+}
+
+/*
+ * Every process counts with its nice weight in the load of its queue,
+ * and that of a container with its shares.
+ */
+static u64 _load_weight(struct proc *p) {
+    if (p->is_scheduler)
+        return ((struct container *)p->cont)->cpu.shares;
+    return (u64)nice_to_weight[p->nice + 20];
+}
+
+/*
+ * Every queued process should run once per CFS_LATENCY_US, in slices in
+ * proportion to its weight.
+ */
+static u64 slice_fair(struct runqueue *rq, struct proc *p) {
+    u64 weight = _load_weight(p);
+    u64 slice = CFS_LATENCY_US * 1000ull * weight / (rq->load + weight);
+    return MAX(slice, CFS_MIN_SLICE_US * 1000ull);
+}
+
+/*
+ * rt_op puts a real-time class in front of cfs_op. SCHED_FIFO and SCHED_RR
+ * processes wait in one FIFO per priority, and a bitmap of the non-empty
+ * ones finds the highest in O(1). They always run before SCHED_OTHER ones,
+ * which are queued as in cfs_op. A SCHED_FIFO process keeps its place at
+ * the head when preempted, a SCHED_RR one goes to the tail.
+ */
+static void init_sched_rt(struct scheduler *this) {
+    init_sched_percpu(this);
+    for (int i = 0; i < NCPU; i++) {
+        struct rt_queue *rt = kalloc();
+        if (rt == NULL)
+            PANIC("init_sched_rt: cannot alloc rt queue");
+        init_bitmap(rt->active, RT_NPRIO);
+        for (int j = 0; j < RT_NPRIO; j++)
+            init_list_node(&rt->queue[j]);
+        this->rq[i].rt = rt;
+    }
+}
+
+/* Real-time priorities rank above every SCHED_OTHER process, which is 0. */
+static INLINE int _rt_prio(struct proc *p) {
+    return p != NULL && p->policy != SCHED_OTHER ? p->rt_priority : 0;
+}
+
+static void enqueue_rt(struct runqueue *rq, struct proc *p, int flags) {
+    int prio = _rt_prio(p);
+    ListNode *queue;
+    if (prio == 0) {
+        enqueue_fair(rq, p, flags);
+        return;
+    }
+    queue = &rq->rt->queue[prio];
+    if (p->policy == SCHED_FIFO && p->preempted)
+        merge_list(queue, &p->rq_node);
+    else
+        merge_list(queue->prev, &p->rq_node);
+    bitmap_set(rq->rt->active, (usize)prio);
+    rq->nr++;
+}
+
+static void _rt_detach(struct runqueue *rq, struct proc *p, int prio) {
+    detach_from_list(&p->rq_node);
+    if (rq->rt->queue[prio].next == &rq->rt->queue[prio])
+        bitmap_clear(rq->rt->active, (usize)prio);
+    rq->nr--;
+}
+
+static struct proc *pick_rt(struct runqueue *rq, int flags) {
+    struct proc *p;
+    for (int i = BITMAP_TO_NUM_CELLS(RT_NPRIO) - 1; i >= 0; i--) {
+        BitmapCell cell = rq->rt->active[i];
+        if (cell == 0)
+            continue;
+        usize prio = (usize)(i + 1) * BITMAP_BITS_PER_CELL - 1 - (usize)__builtin_clzll(cell);
+        p = container_of(rq->rt->queue[prio].next, struct proc, rq_node);
+        _rt_detach(rq, p, (int)prio);
+        return p;
+    }
+    return pick_fair(rq, flags);
+}
+
+static void dequeue_rt(struct runqueue *rq, struct proc *p, int flags) {
+    int prio = _rt_prio(p);
+    if (prio == 0)
+        dequeue_fair(rq, p, flags);
+    else
+        _rt_detach(rq, p, prio);
+}
+
+static void put_prev_rt(struct runqueue *rq, struct proc *p) {
+    if (_rt_prio(p) == 0)
+        put_prev_fair(rq, p);
+}
+
+static u64 slice_rt(struct runqueue *rq, struct proc *p) {
+    switch (p->policy) {
+        case SCHED_FIFO: return 0;
+        case SCHED_RR: return RR_SLICE_US * 1000;
+        default: return slice_fair(rq, p);
+    }
+}
+
+/*
+ * Preempt the CPU p is queued on right away if p outranks what it runs.
+ * That CPU holds the queue lock we hold whenever it changes its proc.
+ */
+static void activate_rt(struct scheduler *this, struct proc *p) {
+    struct cpu *c = &cpus[p->cpu];
+    activate_percpu(this, p);
+    if (_rt_prio(p) > _rt_prio(c->proc)) {
+        c->need_resched = true;
+        if (p->cpu != (int)cpuid())
+            send_ipi((usize)p->cpu);
+    }
+}
+
 #endif
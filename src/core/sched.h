@@ -1,7 +1,9 @@
 #pragma once
 
 #include <aarch64/intrinsic.h>
+#include <common/bitmap.h>
 #include <common/defines.h>
+#include <common/list.h>
 #include <common/spinlock.h>
 #include <core/console.h>
 #include <core/proc.h>
@@ -87,28 +89,137 @@ static INLINE void release_sched_lock() {
 #else
 
 struct scheduler;
+struct runqueue;
 struct sched_op {
-    void (*init)();
+    void (*init)(struct scheduler *this);
+    /* Loop of each CPU, only run by the scheduler of the root container. */
     void (*scheduler)(struct scheduler *this);
+    /*
+     * Take the process to run next on this CPU, or NULL if there is none,
+     * and put it back once its run there has ended, queued again if still
+     * RUNNABLE. Must hold the lock of the running CPU.
+     */
+    struct proc *(*pick_next)(struct scheduler *this);
+    void (*put_back)(struct scheduler *this, struct proc *p);
     struct proc *(*alloc_pcb)(struct scheduler *this);
     void (*sched)(struct scheduler *this);
     void (*acquire_lock)(struct scheduler *this);
     void (*release_lock)(struct scheduler *this);
     struct context *(*get_context)(struct scheduler *this);
+    /*
+     * The lock protecting the run state of p, which is held across swtch.
+     * p == NULL means the lock of the running CPU.
+     */
+    SpinLock *(*get_lock)(struct scheduler *this, struct proc *p);
+    /* Make p RUNNABLE. Must hold get_lock(this, p). */
+    void (*activate)(struct scheduler *this, struct proc *p);
+
+    /*
+     * Queue discipline of the schedulers built on per-CPU run queues.
+     * dequeue takes p off rq wherever it is queued. put_prev accounts the
+     * run that just ended, before p is queued again if still RUNNABLE.
+     */
+    void (*enqueue)(struct runqueue *rq, struct proc *p, int flags);
+    struct proc *(*pick)(struct runqueue *rq, int flags);
+    void (*dequeue)(struct runqueue *rq, struct proc *p, int flags);
+    void (*put_prev)(struct runqueue *rq, struct proc *p);
+    /*
+     * How long p may run before the tick preempts it, in ns, or 0 for no
+     * limit. p has just been picked from rq, which may be NULL for a
+     * scheduler without run queues.
+     */
+    u64 (*slice)(struct runqueue *rq, struct proc *p);
 };
 extern struct sched_op simple_op;
+extern struct sched_op percpu_op;
+extern struct sched_op cfs_op;
+extern struct sched_op rt_op;
 
-#define NCPU 4 /* maximum number of CPUs */
+/* flags of enqueue, pick and dequeue. */
+#define RQ_WAKEUP  1 /* p was sleeping or is new */
+#define RQ_MIGRATE 2 /* p moves to the queue of another CPU */
+
+#define NCPU         4                    /* maximum number of CPUs */
+#define NPIDHASH     32                   /* buckets of the pid hash of a scheduler */
+#define CPU_MASK_ALL ((1ull << NCPU) - 1) /* affinity of a new process */
+
+/* Time slices: how long a process may run while others are RUNNABLE. */
+#define SLICE_US         10000  /* simple_op, percpu_op */
+#define CFS_LATENCY_US   6000   /* cfs_op: every queued process runs once in this */
+#define CFS_MIN_SLICE_US 750    /* cfs_op: however many are queued */
+#define RR_SLICE_US      100000 /* rt_op: SCHED_RR. SCHED_FIFO runs until it blocks */
+
+/* Load balancing of the per-CPU schedulers. */
+#define BALANCE_MS        4   /* period of the balancing pass of each CPU */
+#define CACHE_HOT_US      500 /* a process that ran this recently is cache-hot */
+#define BALANCE_HOT_TRIES 2   /* failed passes before cache-hot ones move too */
+
+/* Scheduling policies, numbered as in <sched.h> of libc. */
+#define SCHED_OTHER 0
+#define SCHED_FIFO  1
+#define SCHED_RR    2
+
+#define RT_NPRIO 100 /* SCHED_FIFO/SCHED_RR priorities are 1 ... 99 */
+
+/* One FIFO per real-time priority, and a bit for each that is non-empty. */
+struct rt_queue {
+    Bitmap(active, RT_NPRIO);
+    ListNode queue[RT_NPRIO];
+};
+
+/* Load balancing counters of one CPU, for tuning the balance policy. */
+struct sched_stat {
+    u64 balance;        /* Balancing passes */
+    u64 balance_failed; /* Passes that found an imbalance but moved nothing */
+    u64 migrations;     /* Processes pulled to this CPU */
+    u64 hot_skipped;    /* Processes left where they were for being cache-hot */
+};
+
+/* CPU time of a container, in microseconds, like cpu.stat of cgroups. */
+struct cpu_stat {
+    u64 usage_us;       /* Run time, that of nested containers included */
+    u64 nr_periods;     /* Periods it ran in with a quota */
+    u64 nr_throttled;   /* Periods it ran out of quota in */
+    u64 throttled_us;   /* Time spent throttled */
+    u64 shares;         /* Its weight, see set_container_cpu */
+    u64 quota_us;       /* 0 if unlimited */
+    u64 period_us;
+};
+
+/* RUNNABLE processes owned by one CPU. */
+struct runqueue {
+    SpinLock lock;
+    int nr;          /* Number of queued processes */
+    ListNode queued; /* All of them, in the order they were queued */
+    u64 load;        /* Their load weights */
+    u64 curr_load;   /* Load weight of the one running, 0 if none */
+
+    u64 next_balance;      /* Timestamp of the next periodic balancing pass */
+    int balance_failed;    /* Failed passes in a row */
+    struct sched_stat stat;
+
+    ListNode head; /* percpu_op: FIFO */
+
+    struct proc *heap; /* cfs_op, rt_op: ordered by vruntime */
+    i64 min_vruntime;  /* cfs_op, rt_op: never decreases */
+
+    struct rt_queue *rt; /* rt_op: a page of its own */
+};
 
 struct scheduler {
     // struct sched_obj sched;
     struct sched_op *op;
-    struct context *context[NCPU];
+    struct context *context[NCPU]; /* Loop of each CPU, in the root container only */
+    /*
+     * Processes of this scheduler. The lock also guards the parent, child
+     * and thread links between them.
+     */
     struct {
-        struct proc proc[NPROC];
+        ListNode procs;              /* All of them, linked by ptable_node */
+        ListNode pid_hash[NPIDHASH]; /* By pid, linked by pid_node */
         SpinLock lock;
     } ptable;
-    int pid;
+    struct runqueue rq[NCPU];
     struct scheduler *parent;
     struct container *cont;
 };
@@ -116,6 +227,9 @@ struct scheduler {
 struct cpu {
     struct scheduler *scheduler;
     struct proc *proc;
+    bool need_resched; /* Something more urgent than proc is RUNNABLE */
+    bool idle;         /* Waiting for an interrupt with the tick stopped */
+    struct proc *fpsimd_owner; /* Whose state the FP/SIMD registers hold */
 };
 extern struct cpu cpus[NCPU];
 
@@ -123,10 +237,17 @@ static INLINE struct cpu *thiscpu() {
     return &cpus[cpuid()];
 }
 
-static INLINE void init_sched() {
-    // thiscpu()->scheduler->op->init();
-    // simple_scheduler.op->init();
-}
+void init_sched();
+void free_pcb(struct scheduler *this, struct proc *p);
+struct proc *lookup_pcb(struct scheduler *this, int pid);
+void account_time(struct proc *p, u64 *counter);
+void set_cpus_allowed(struct proc *p, u64 mask);
+void set_sched_policy(struct proc *p, int policy, int prio);
+
+struct container;
+void init_container_cpu(struct container *c);
+int set_container_cpu(struct container *c, u64 shares, u64 quota_us, u64 period_us);
+void get_container_cpu_stat(struct container *c, struct cpu_stat *st);
 
 static INLINE void init_cpu(struct scheduler *scheduler) {
     thiscpu()->scheduler = scheduler;
@@ -158,4 +279,17 @@ static INLINE void acquire_sched_lock() {
 static INLINE void release_sched_lock() {
     thiscpu()->scheduler->op->release_lock(thiscpu()->scheduler);
 }
+
+static INLINE SpinLock *sched_lock() {
+    return thiscpu()->scheduler->op->get_lock(thiscpu()->scheduler, NULL);
+}
+
+/* Make a proc that is not on any queue RUNNABLE. */
+static INLINE void activate(struct proc *p) {
+    struct scheduler *s = thiscpu()->scheduler;
+    SpinLock *lock = s->op->get_lock(s, p);
+    acquire_spinlock(lock);
+    s->op->activate(s, p);
+    release_spinlock(lock);
+}
 #endif
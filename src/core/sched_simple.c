@@ -62,7 +62,7 @@ static void scheduler_simple() {
         acquire_ptable_lock();
         for (p = ptable.proc; p < ptable.proc + NPROC; p++) {
             if (p->state == RUNNABLE) {
-                uvm_switch(p->pgdir);
+                uvm_switch(p->mm->pgdir);
                 c->proc = p;
                 p->state = RUNNING;
                 swtch(&c->scheduler->context, p->context);
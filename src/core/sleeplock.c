@@ -19,5 +19,6 @@ void release_sleeplock(SleepLock *lock) {
     acquire_spinlock(&lock->lock);
     lock->locked = false;
     release_spinlock(&lock->lock);
-    wakeup(lock);
+    /* Each waiter retries the lock, so waking more only makes them spin. */
+    wakeup_one(lock);
 }
@@ -31,17 +31,33 @@ int sys_default() {
 
 #define NR_SYSCALL 512
 int (*syscall_table[NR_SYSCALL])() = {[0 ... NR_SYSCALL - 1] = sys_default,
-                                      [SYS_set_tid_address] = sys_gettid,
+                                      [SYS_set_tid_address] = sys_set_tid_address,
                                       [SYS_ioctl] = sys_ioctl,
                                       [SYS_gettid] = sys_gettid,
+                                      [SYS_getpid] = sys_getpid,
                                       [SYS_rt_sigprocmask] = sys_sigprocmask,
                                       [SYS_brk] = (int (*)())sys_brk,
+                                      [SYS_mmap] = (int (*)())sys_mmap,
+                                      [SYS_munmap] = sys_munmap,
                                       [SYS_execve] = sys_exec,
                                       [SYS_sched_yield] = sys_yield,
+                                      [SYS_futex] = sys_futex,
                                       [SYS_clone] = sys_clone,
                                       [SYS_wait4] = sys_wait4,
-                                      [SYS_exit_group] = sys_exit,
+                                      [SYS_exit_group] = sys_exit_group,
                                       [SYS_exit] = sys_exit,
+                                      [SYS_setpriority] = sys_setpriority,
+                                      [SYS_getpriority] = sys_getpriority,
+                                      [SYS_sched_setscheduler] = sys_sched_setscheduler,
+                                      [SYS_sched_getscheduler] = sys_sched_getscheduler,
+                                      [SYS_sched_getparam] = sys_sched_getparam,
+                                      [SYS_sched_setaffinity] = sys_sched_setaffinity,
+                                      [SYS_sched_getaffinity] = sys_sched_getaffinity,
+                                      [SYS_nanosleep] = sys_nanosleep,
+                                      [SYS_clock_nanosleep] = sys_clock_nanosleep,
+                                      [SYS_clock_gettime] = sys_clock_gettime,
+                                      [SYS_getrusage] = sys_getrusage,
+                                      [SYS_times] = sys_times,
                                       [SYS_dup] = sys_dup,
                                       [SYS_chdir] = sys_chdir,
                                       [SYS_fstat] = sys_fstat,
@@ -49,24 +65,53 @@ int (*syscall_table[NR_SYSCALL])() = {[0 ... NR_SYSCALL - 1] = sys_default,
                                       [SYS_mkdirat] = sys_mkdirat,
                                       [SYS_mknodat] = sys_mknodat,
                                       [SYS_openat] = sys_openat,
+                                      [SYS_readv] = (int (*)())sys_readv,
                                       [SYS_writev] = (int (*)())sys_writev,
+                                      [SYS_pread64] = (int (*)())sys_pread64,
+                                      [SYS_pwrite64] = (int (*)())sys_pwrite64,
+                                      [SYS_preadv] = (int (*)())sys_preadv,
+                                      [SYS_pwritev] = (int (*)())sys_pwritev,
+                                      [SYS_copy_file_range] = (int (*)())sys_copy_file_range,
+                                      [SYS_sendfile] = (int (*)())sys_sendfile,
                                       [SYS_read] = (int (*)())sys_read,
                                       [SYS_write] = (int (*)())sys_write,
                                       [SYS_close] = sys_close,
-                                      [SYS_myyield] = sys_yield};
+                                      [SYS_myyield] = sys_yield,
+                                      [SYS_myschedstat] = sys_myschedstat,
+                                      [SYS_mycpustat] = sys_mycpustat,
+                                      [SYS_mycpulimit] = sys_mycpulimit,
+                                      [SYS_mymemstat] = sys_mymemstat,
+                                      [SYS_mymemlimit] = sys_mymemlimit,
+                                      [SYS_mybuddyinfo] = sys_mybuddyinfo};
 
 const char(*syscall_table_str[NR_SYSCALL]) = {[0 ... NR_SYSCALL - 1] = "sys_default",
-                                              [SYS_set_tid_address] = "sys_gettid",
+                                              [SYS_set_tid_address] = "sys_set_tid_address",
                                               [SYS_ioctl] = "sys_ioctl",
                                               [SYS_gettid] = "sys_gettid",
+                                              [SYS_getpid] = "sys_getpid",
                                               [SYS_rt_sigprocmask] = "sys_sigprocmask",
                                               [SYS_brk] = "sys_brk",
+                                              [SYS_mmap] = "sys_mmap",
+                                              [SYS_munmap] = "sys_munmap",
                                               [SYS_execve] = "sys_exec",
                                               [SYS_sched_yield] = "sys_yield",
+                                              [SYS_futex] = "sys_futex",
                                               [SYS_clone] = "sys_clone",
                                               [SYS_wait4] = "sys_wait4",
-                                              [SYS_exit_group] = "sys_exit",
+                                              [SYS_exit_group] = "sys_exit_group",
                                               [SYS_exit] = "sys_exit",
+                                              [SYS_setpriority] = "sys_setpriority",
+                                              [SYS_getpriority] = "sys_getpriority",
+                                              [SYS_sched_setscheduler] = "sys_sched_setscheduler",
+                                              [SYS_sched_getscheduler] = "sys_sched_getscheduler",
+                                              [SYS_sched_getparam] = "sys_sched_getparam",
+                                              [SYS_sched_setaffinity] = "sys_sched_setaffinity",
+                                              [SYS_sched_getaffinity] = "sys_sched_getaffinity",
+                                              [SYS_nanosleep] = "sys_nanosleep",
+                                              [SYS_clock_nanosleep] = "sys_clock_nanosleep",
+                                              [SYS_clock_gettime] = "sys_clock_gettime",
+                                              [SYS_getrusage] = "sys_getrusage",
+                                              [SYS_times] = "sys_times",
                                               [SYS_dup] = "sys_dup",
                                               [SYS_chdir] = "sys_chdir",
                                               [SYS_fstat] = "sys_fstat",
@@ -74,11 +119,24 @@ const char(*syscall_table_str[NR_SYSCALL]) = {[0 ... NR_SYSCALL - 1] = "sys_defa
                                               [SYS_mkdirat] = "sys_mkdirat",
                                               [SYS_mknodat] = "sys_mknodat",
                                               [SYS_openat] = "sys_openat",
+                                              [SYS_readv] = "sys_readv",
                                               [SYS_writev] = "sys_writev",
+                                              [SYS_pread64] = "sys_pread64",
+                                              [SYS_pwrite64] = "sys_pwrite64",
+                                              [SYS_preadv] = "sys_preadv",
+                                              [SYS_pwritev] = "sys_pwritev",
+                                              [SYS_copy_file_range] = "sys_copy_file_range",
+                                              [SYS_sendfile] = "sys_sendfile",
                                               [SYS_read] = "sys_read",
                                               [SYS_write] = "sys_write",
                                               [SYS_close] = "sys_close",
-                                              [SYS_myyield] = "sys_yield"};
+                                              [SYS_myyield] = "sys_yield",
+                                              [SYS_myschedstat] = "sys_myschedstat",
+                                              [SYS_mycpustat] = "sys_mycpustat",
+                                              [SYS_mycpulimit] = "sys_mycpulimit",
+                                              [SYS_mymemstat] = "sys_mymemstat",
+                                              [SYS_mymemlimit] = "sys_mymemlimit",
+                                              [SYS_mybuddyinfo] = "sys_mybuddyinfo"};
 
 u64 syscall_dispatch(Trapframe *frame) {
     // switch (frame->x[8]) {
@@ -95,31 +153,64 @@ u64 syscall_dispatch(Trapframe *frame) {
 }
 
 /* Check if a block of memory lies within the process user space. */
-int in_user(void *s, usize n) {
+static bool _in_user_range(struct proc *p, u64 s, usize n) {
+    struct mm *mm = p->mm;
+    if (s + n < s)
+        return false;
+    return (mm->base <= s && s + n <= mm->sz) ||
+           (USPACE_TOP - mm->stksz <= s && s + n <= USPACE_TOP) ||
+           (MMAP_BASE <= s && s + n <= MMAP_TOP);
+}
+
+/*
+ * Check if the kernel may write a block of memory in the process user
+ * space. Pages of mmap regions are faulted in. This is only a check:
+ * another thread may unmap the block right after, so the memory itself
+ * is only accessed through copy_from_user and copy_to_user.
+ */
+int in_user_writable(void *s, usize n) {
     struct proc *p = thiscpu()->proc;
-    if ((p->base <= (u64)s && (u64)s + n <= p->sz) ||
-        (USPACE_TOP - p->stksz <= (u64)s && (u64)s + n <= USPACE_TOP))
-        return 1;
-    return 0;
+    return _in_user_range(p, (u64)s, n) && uvm_prefault(p, (u64)s, n, true) == 0;
 }
 
 /*
- * Fetch the nul-terminated string at addr from the current process.
- * Doesn't actually copy the string - just sets *pp to point at it.
- * Returns length of string, not including nul.
+ * Copy n bytes from the user memory of the current process at src.
+ * Returns -1 if a part of it is not accessible.
  */
-int fetchstr(u64 addr, char **pp) {
+int copy_from_user(void *dst, u64 src, usize n) {
+    struct proc *p = thiscpu()->proc;
+    if (!_in_user_range(p, src, n))
+        return -1;
+    return uvm_access(p, src, dst, n, false);
+}
+
+/* Copy n bytes to the user memory of the current process at dst. */
+int copy_to_user(u64 dst, const void *src, usize n) {
     struct proc *p = thiscpu()->proc;
-    char *s;
-    *pp = s = (char *)addr;
-    if (p->base <= addr && addr < p->sz) {
-        for (; (u64)s < p->sz; s++)
-            if (*s == 0)
-                return (int)(s - *pp);
-    } else if (USPACE_TOP - p->stksz <= addr && addr < USPACE_TOP) {
-        for (; (u64)s < USPACE_TOP; s++)
-            if (*s == 0)
-                return (int)(s - *pp);
+    if (!_in_user_range(p, dst, n))
+        return -1;
+    return uvm_access(p, dst, (void *)src, n, true);
+}
+
+/*
+ * Fetch the nul-terminated string at addr from the current process into
+ * buf, which holds max bytes. Returns length of string, not including
+ * nul, or -1 if it is not accessible or too long.
+ */
+int fetchstr(u64 addr, char *buf, usize max) {
+    usize len = 0;
+    while (len < max) {
+        /*
+         * Never read past the page the string goes on in. That page is
+         * accessible as a whole, even where it goes past mm->sz.
+         */
+        usize n = MIN(max - len, PAGE_SIZE - (addr + len) % PAGE_SIZE);
+        if (uvm_access(thiscpu()->proc, addr + len, buf + len, n, false) < 0)
+            return -1;
+        for (usize end = len + n; len < end; len++) {
+            if (buf[len] == 0)
+                return (int)len;
+        }
     }
     return -1;
 }
@@ -157,33 +248,13 @@ int argu64(int n, u64 *ip) {
 }
 
 /*
- * Fetch the nth word-sized system call argument as a pointer
- * to a block of memory of size bytes. Check that the pointer+
- * lies within the process address space.
- */
-int argptr(int n, char **pp, usize size) {
-    u64 i = 0;
-    if (argu64(n, &i) < 0) {
-        return -1;
-    }
-    if (in_user((void *)i, size)) {
-        *pp = (char *)i;
-        return 0;
-    } else {
-        return -1;
-    }
-}
-
-/*
- * Fetch the nth word-sized system call argument as a string pointer.
- * Check that the pointer is valid and the string is nul-terminated.
- * (There is no shared writable memory, so the string can't change
- * between this check and being used by the kernel.)
+ * Fetch the nth word-sized system call argument as a string pointer,
+ * and copy the string into buf, which holds max bytes. Returns length
+ * of string, not including nul.
  */
-int argstr(int n, char **pp) {
+int argstr(int n, char *buf, usize max) {
     u64 addr = 0;
     if (argu64(n, &addr) < 0)
         return -1;
-    int r = fetchstr(addr, pp);
-    return r;
+    return fetchstr(addr, buf, max);
 }
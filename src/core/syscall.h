@@ -10,14 +10,45 @@ void sys_myprint(int x);
 u64 syscall_dispatch(Trapframe *frame);
 
 int sys_yield();
+int sys_futex();
 usize sys_brk();
+u64 sys_mmap();
+int sys_munmap();
 int sys_clone();
 int sys_wait4();
 int sys_exit();
+int sys_exit_group();
+int sys_set_tid_address();
+int sys_getpid();
+int sys_setpriority();
+int sys_getpriority();
+int sys_sched_setscheduler();
+int sys_sched_getscheduler();
+int sys_sched_getparam();
+int sys_sched_setaffinity();
+int sys_sched_getaffinity();
+int sys_myschedstat();
+int sys_mycpustat();
+int sys_mycpulimit();
+int sys_mymemstat();
+int sys_mymemlimit();
+int sys_mybuddyinfo();
+int sys_nanosleep();
+int sys_clock_nanosleep();
+int sys_clock_gettime();
+int sys_getrusage();
+int sys_times();
 int sys_dup();
 isize sys_read();
 isize sys_write();
+isize sys_readv();
 isize sys_writev();
+isize sys_pread64();
+isize sys_pwrite64();
+isize sys_preadv();
+isize sys_pwritev();
+isize sys_copy_file_range();
+isize sys_sendfile();
 int sys_close();
 int sys_fstat();
 int sys_fstatat();
@@ -28,9 +59,12 @@ int sys_mknodat();
 int sys_chdir();
 int sys_exec();
 
-int in_user(void *s, usize n);
-int fetchstr(u64 addr, char **pp);
+#define MAXPATH 128 /* Longest path passed to a system call, nul included */
+
+int in_user_writable(void *s, usize n);
+int copy_from_user(void *dst, u64 src, usize n);
+int copy_to_user(u64 dst, const void *src, usize n);
+int fetchstr(u64 addr, char *buf, usize max);
 int argint(int n, int *ip);
 int argu64(int n, u64 *ip);
-int argptr(int n, char **pp, usize size);
-int argstr(int n, char **pp);
+int argstr(int n, char *buf, usize max);
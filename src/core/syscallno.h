@@ -1,6 +1,12 @@
 #pragma once
 
-#define SYS_myexecve 456
-#define SYS_myexit   457
-#define SYS_myprint  458
-#define SYS_myyield  459
+#define SYS_myexecve    456
+#define SYS_myexit      457
+#define SYS_myprint     458
+#define SYS_myyield     459
+#define SYS_myschedstat 460
+#define SYS_mycpustat   461
+#define SYS_mycpulimit  462
+#define SYS_mymemstat   463
+#define SYS_mymemlimit  464
+#define SYS_mybuddyinfo 465
@@ -5,11 +5,13 @@
 //
 
 #include <fcntl.h>
+#include <sys/mman.h>
 
 #include <aarch64/mmu.h>
 #include <common/defines.h>
 #include <common/spinlock.h>
 #include <core/console.h>
+#include <core/physical_memory.h>
 #include <core/proc.h>
 #include <core/sched.h>
 #include <core/sleeplock.h>
@@ -18,14 +20,10 @@
 
 #include "syscall.h"
 
-struct iovec {
-    void *iov_base; /* Starting address. */
-    usize iov_len;  /* Number of bytes to transfer. */
-};
-
 /*
  * Fetch the nth word-sized system call argument as a file descriptor
  * and return both the descriptor and the corresponding struct file.
+ * The file comes with a reference the caller must fileclose.
  */
 static int argfd(int n, i64 *pfd, struct file **pf) {
     i32 fd;
@@ -33,7 +31,7 @@ static int argfd(int n, i64 *pfd, struct file **pf) {
 
     if (argint(n, &fd) < 0)
         return -1;
-    if (fd < 0 || fd >= NOFILE || (f = thiscpu()->proc->ofile[fd]) == 0)
+    if ((f = fdtable_get(&thiscpu()->proc->group_leader->fdtable, fd)) == 0)
         return -1;
     if (pfd)
         *pfd = fd;
@@ -42,19 +40,118 @@ static int argfd(int n, i64 *pfd, struct file **pf) {
     return 0;
 }
 
+/*
+ * Fetch the nth word-sized system call argument as an optional pointer
+ * to a file offset, and the offset there. A null pointer is passed
+ * through, and *off is left alone then.
+ */
+static int argoff(int n, u64 *addr, usize *off) {
+    if (argu64(n, addr) < 0)
+        return -1;
+    if (*addr != 0 && copy_from_user(off, *addr, sizeof(*off)) < 0)
+        return -1;
+    return 0;
+}
+
+/* Store back an offset fetched by argoff. */
+static int putoff(u64 addr, usize off) {
+    if (addr != 0 && copy_to_user(addr, &off, sizeof(off)) < 0)
+        return -1;
+    return 0;
+}
+
+#define NIOV (PAGE_SIZE / sizeof(struct iovec)) /* Longest iovec array */
+
+/*
+ * Fetch the nth and (n+1)th system call arguments as an iovec array
+ * and its length, and copy the array into iov, which holds NIOV.
+ */
+static int argiov(int n, struct iovec *iov, int *piovcnt) {
+    u64 addr;
+    i32 iovcnt;
+
+    if (argu64(n, &addr) < 0 || argint(n + 1, &iovcnt) < 0 || iovcnt < 0 ||
+        (usize)iovcnt > NIOV ||
+        copy_from_user(iov, addr, (usize)iovcnt * sizeof(struct iovec)) < 0)
+        return -1;
+    *piovcnt = iovcnt;
+    return 0;
+}
+
+/*
+ * Copy n bytes between buf and the user segments from *seg, *seg_off on,
+ * to them if to_user, and move past them. With buf NULL, only move past.
+ */
+static int _copy_segs(char *buf, usize n, struct iovec **seg, usize *seg_off, bool to_user) {
+    while (n > 0) {
+        usize k = MIN(n, (*seg)->iov_len - *seg_off);
+        u64 addr = (u64)(*seg)->iov_base + *seg_off;
+        if (buf != NULL) {
+            if (to_user ? copy_to_user(addr, buf, k) < 0 : copy_from_user(buf, addr, k) < 0)
+                return -1;
+            buf += k;
+        }
+        n -= k;
+        *seg_off += k;
+        if (*seg_off == (*seg)->iov_len) {
+            (*seg)++;
+            *seg_off = 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read from f into the user segments of iov, or write them to f, at *off
+ * or the file offset if off is NULL. The data goes through a bounce page,
+ * so that user memory is only reached by copy_from_user and copy_to_user,
+ * and never under a file lock. Segments are packed a page at a time, and
+ * each page takes a single filereadv or filewritev.
+ */
+static isize _rw_user(struct file *f, struct iovec *iov, int iovcnt, usize *off, bool write) {
+    if (write ? f->writable == 0 : f->readable == 0)
+        return -1;
+    char *buf = kalloc();
+    if (buf == NULL)
+        return -1;
+
+    usize tot = 0, seg_off = 0;
+    struct iovec *seg = iov;
+    bool failed = false;
+    for (;;) {
+        usize n = 0;
+        for (struct iovec *p = seg; p < iov + iovcnt && n < PAGE_SIZE; p++)
+            n += MIN(PAGE_SIZE - n, p->iov_len - (p == seg ? seg_off : 0));
+        if (n == 0)
+            break;
+
+        struct iovec *from = seg;
+        usize from_off = seg_off;
+        if (write && _copy_segs(buf, n, &from, &from_off, false) < 0) {
+            failed = true;
+            break;
+        }
+        struct iovec page = {.iov_base = buf, .iov_len = n};
+        isize r = write ? filewritev(f, &page, 1, off) : filereadv(f, &page, 1, off);
+        if (r < 0 || _copy_segs(write ? NULL : buf, (usize)r, &seg, &seg_off, true) < 0) {
+            failed = true;
+            break;
+        }
+        tot += (usize)r;
+        if ((usize)r < n)
+            break;
+    }
+
+    kfree(buf);
+    return failed && tot == 0 ? -1 : (isize)tot;
+}
+
 /*
  * Allocate a file descriptor for the given file.
  * Takes over file reference from caller on success.
  */
 static int fdalloc(struct file *f) {
-    /* TODO: Your code here. */
-    for (int i = 0; i < NOFILE; i++) {
-        if (thiscpu()->proc->ofile[i] == 0) {
-            thiscpu()->proc->ofile[i] = f;
-            return i;
-        }
-    }
-    return -1;
+    return fdtable_alloc(&thiscpu()->proc->group_leader->fdtable, f);
 }
 
 int sys_dup() {
@@ -66,89 +163,218 @@ int sys_dup() {
 
     int fd = fdalloc(f);
     if (fd < 0) {
+        fileclose(f);
         return -1;
     }
-    filedup(f);
     return fd;
 }
 
+/* Fetch the nth and (n+1)th system call arguments as a single segment. */
+static int argseg(int n, struct iovec *iov) {
+    u64 addr;
+    i32 len;
+
+    if (argu64(n, &addr) < 0 || argint(n + 1, &len) < 0 || len < 0)
+        return -1;
+    iov->iov_base = (void *)addr;
+    iov->iov_len = (usize)len;
+    return 0;
+}
+
 isize sys_read() {
     /* TODO: Your code here. */
     struct file *f;
-    char *addr;
-    i32 n;
+    struct iovec iov;
 
-    if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &addr, (usize)n) < 0) {
+    if (argseg(1, &iov) < 0 || argfd(0, 0, &f) < 0) {
         return -1;
     }
-    return fileread(f, addr, n);
+    isize r = _rw_user(f, &iov, 1, NULL, false);
+    fileclose(f);
+    return r;
 }
 
 isize sys_write() {
     /* TODO: Your code here. */
     struct file *f;
-    char *addr;
-    i32 n;
+    struct iovec iov;
 
-    if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &addr, (usize)n) < 0) {
+    if (argseg(1, &iov) < 0 || argfd(0, 0, &f) < 0) {
         return -1;
     }
-    return filewrite(f, addr, n);
+    isize r = _rw_user(f, &iov, 1, NULL, true);
+    fileclose(f);
+    return r;
+}
+
+/* readv and friends copy the iovec array into a page of their own. */
+static isize _rw_vector(struct file *f, int n, usize *off, bool write) {
+    struct iovec *iov = kalloc();
+    int iovcnt;
+    isize r = -1;
+
+    if (iov == NULL)
+        return -1;
+    if (argiov(n, iov, &iovcnt) == 0)
+        r = _rw_user(f, iov, iovcnt, off, write);
+    kfree(iov);
+    return r;
+}
+
+isize sys_readv() {
+    struct file *f;
+
+    if (argfd(0, 0, &f) < 0)
+        return -1;
+    isize r = _rw_vector(f, 1, NULL, false);
+    fileclose(f);
+    return r;
 }
 
 isize sys_writev() {
-    /* TODO: Your code here. */
+    struct file *f;
+
+    if (argfd(0, 0, &f) < 0)
+        return -1;
+    isize r = _rw_vector(f, 1, NULL, true);
+    fileclose(f);
+    return r;
+}
+
+/*
+ * Positional reads and writes use their own offset and leave
+ * f->off untouched, so threads can share one file.
+ */
+isize sys_pread64() {
+    struct file *f;
+    struct iovec iov;
+    u64 off;
+
+    if (argseg(1, &iov) < 0 || argu64(3, &off) < 0 || (i64)off < 0 || argfd(0, 0, &f) < 0)
+        return -1;
+    isize r = _rw_user(f, &iov, 1, &off, false);
+    fileclose(f);
+    return r;
+}
+
+isize sys_pwrite64() {
+    struct file *f;
+    struct iovec iov;
+    u64 off;
 
-    /* Example code.
-     *
-     * ```
-     * struct file *f;
-     * i64 fd, iovcnt;
-     * struct iovec *iov, *p;
-     * if (argfd(0, &fd, &f) < 0 ||
-     *     argint(2, &iovcnt) < 0 ||
-     *     argptr(1, &iov, iovcnt * sizeof(struct iovec)) < 0) {
-     *     return -1;
-     * }
-     *
-     * usize tot = 0;
-     * for (p = iov; p < iov + iovcnt; p++) {
-     *     // in_user(p, n) checks if va [p, p+n) lies in user address space.
-     *     if (!in_user(p->iov_base, p->iov_len))
-     *          return -1;
-     *     tot += filewrite(f, p->iov_base, p->iov_len);
-     * }
-     * return tot;
-     * ```
-     */
+    if (argseg(1, &iov) < 0 || argu64(3, &off) < 0 || (i64)off < 0 || argfd(0, 0, &f) < 0)
+        return -1;
+    isize r = _rw_user(f, &iov, 1, &off, true);
+    fileclose(f);
+    return r;
+}
 
+isize sys_preadv() {
     struct file *f;
-    i32 fd, iovcnt;
-    struct iovec *iov;
-    if (argfd(0, (i64 *)&fd, &f) < 0 || argint(2, &iovcnt) < 0 ||
-        argptr(1, (char **)&iov, (u64)iovcnt * sizeof(struct iovec)) < 0) {
+    u64 off;
+
+    if (argu64(3, &off) < 0 || (i64)off < 0 || argfd(0, 0, &f) < 0)
+        return -1;
+    isize r = _rw_vector(f, 1, &off, false);
+    fileclose(f);
+    return r;
+}
+
+isize sys_pwritev() {
+    struct file *f;
+    u64 off;
+
+    if (argu64(3, &off) < 0 || (i64)off < 0 || argfd(0, 0, &f) < 0)
+        return -1;
+    isize r = _rw_vector(f, 1, &off, true);
+    fileclose(f);
+    return r;
+}
+
+/*
+ * Map a file or anonymous memory. Pages are mapped lazily by the
+ * page fault handler; see uvm_fault.
+ */
+u64 sys_mmap() {
+    u64 addr, len, off;
+    i32 prot, flags;
+    struct file *f = NULL;
+
+    if (argu64(0, &addr) < 0 || argu64(1, &len) < 0 || argint(2, &prot) < 0 ||
+        argint(3, &flags) < 0 || argu64(5, &off) < 0)
+        return (u64)-1;
+    if (!(flags & MAP_ANONYMOUS) && argfd(4, 0, &f) < 0)
+        return (u64)-1;
+    u64 r = uvm_mmap(thiscpu()->proc, addr, len, prot, flags, f, off);
+    if (f != NULL)
+        fileclose(f);
+    return r;
+}
+
+int sys_munmap() {
+    u64 addr, len;
+
+    if (argu64(0, &addr) < 0 || argu64(1, &len) < 0)
+        return -1;
+    return uvm_munmap(thiscpu()->proc, addr, len);
+}
+
+isize sys_copy_file_range() {
+    struct file *in, *out;
+    u64 in_addr, out_addr, len;
+    usize in_off = 0, out_off = 0;
+    i32 flags;
+
+    if (argoff(1, &in_addr, &in_off) < 0 || argoff(3, &out_addr, &out_off) < 0 ||
+        argu64(4, &len) < 0 || argint(5, &flags) < 0)
+        return -1;
+    if (flags != 0) {
+        printf("sys_copy_file_range: flags unimplemented\n");
         return -1;
     }
-    usize tot = 0;
-    for (struct iovec *p = iov; p < iov + iovcnt; p++) {
-        if (0) {
-            return -1;
-        }
-        tot += (usize)filewrite(f, p->iov_base, (isize)p->iov_len);
+    if (argfd(0, 0, &in) < 0)
+        return -1;
+    if (argfd(2, 0, &out) < 0) {
+        fileclose(in);
+        return -1;
     }
-    return (isize)tot;
+    isize r = filecopy(in, in_addr ? &in_off : NULL, out, out_addr ? &out_off : NULL, len);
+    fileclose(out);
+    fileclose(in);
+    if (putoff(in_addr, in_off) < 0 || putoff(out_addr, out_off) < 0)
+        return -1;
+    return r;
+}
+
+isize sys_sendfile() {
+    struct file *in, *out;
+    u64 addr, count;
+    usize offset = 0;
+
+    if (argoff(2, &addr, &offset) < 0 || argu64(3, &count) < 0 || argfd(0, 0, &out) < 0)
+        return -1;
+    if (argfd(1, 0, &in) < 0) {
+        fileclose(out);
+        return -1;
+    }
+    isize r = filesend(in, addr ? &offset : NULL, out, count);
+    fileclose(in);
+    fileclose(out);
+    if (putoff(addr, offset) < 0)
+        return -1;
+    return r;
 }
 
 int sys_close() {
     /* TODO: Your code here. */
     struct file *f;
-    int fd;
+    i32 fd;
 
-    if (argfd(0, (i64 *)&fd, &f) < 0) {
+    /* Only the thread that frees fd closes the file it held. */
+    if (argint(0, &fd) < 0 ||
+        (f = fdtable_remove(&thiscpu()->proc->group_leader->fdtable, fd)) == 0) {
         return -1;
     }
-
-    thiscpu()->proc->ofile[fd] = 0;
     fileclose(f);
 
     return 0;
@@ -157,21 +383,27 @@ int sys_close() {
 int sys_fstat() {
     /* TODO: Your code here. */
     struct file *f;
-    struct stat *st;
+    struct stat st;
+    u64 addr;
 
-    if (argfd(0, 0, &f) < 0 || argptr(1, (void *)&st, sizeof(*st)) < 0) {
+    if (argu64(1, &addr) < 0 || argfd(0, 0, &f) < 0) {
         return -1;
     }
 
-    return filestat(f, st);
+    int r = filestat(f, &st);
+    fileclose(f);
+    if (r < 0)
+        return -1;
+    return copy_to_user(addr, &st, sizeof(st));
 }
 
 int sys_fstatat() {
     i32 dirfd, flags;
-    char *path;
-    struct stat *st;
+    char path[MAXPATH];
+    struct stat st;
+    u64 addr;
 
-    if (argint(0, &dirfd) < 0 || argstr(1, &path) < 0 || argptr(2, (void *)&st, sizeof(*st)) < 0 ||
+    if (argint(0, &dirfd) < 0 || argstr(1, path, sizeof(path)) < 0 || argu64(2, &addr) < 0 ||
         argint(3, &flags) < 0)
         return -1;
 
@@ -192,12 +424,12 @@ int sys_fstatat() {
         return -1;
     }
     inodes.lock(ip);
-    stati(ip, st);
+    stati(ip, &st);
     inodes.unlock(ip);
     inodes.put(&ctx, ip);
     bcache.end_op(&ctx);
 
-    return 0;
+    return copy_to_user(addr, &st, sizeof(st));
 }
 
 Inode *create(char *path, short type, short major, short minor, OpContext *ctx) {
@@ -245,12 +477,12 @@ Inode *create(char *path, short type, short major, short minor, OpContext *ctx)
 }
 
 int sys_openat() {
-    char *path;
+    char path[MAXPATH];
     int dirfd, fd, omode;
     struct file *f;
     Inode *ip;
 
-    if (argint(0, &dirfd) < 0 || argstr(1, &path) < 0 || argint(2, &omode) < 0)
+    if (argint(0, &dirfd) < 0 || argstr(1, path, sizeof(path)) < 0 || argint(2, &omode) < 0)
         return -1;
 
     // printf("%d, %s, %lld\n", dirfd, path, omode);
@@ -307,10 +539,10 @@ int sys_openat() {
 
 int sys_mkdirat() {
     i32 dirfd, mode;
-    char *path;
+    char path[MAXPATH];
     Inode *ip;
 
-    if (argint(0, &dirfd) < 0 || argstr(1, &path) < 0 || argint(2, &mode) < 0)
+    if (argint(0, &dirfd) < 0 || argstr(1, path, sizeof(path)) < 0 || argint(2, &mode) < 0)
         return -1;
     if (dirfd != AT_FDCWD) {
         printf("sys_mkdirat: dirfd unimplemented\n");
@@ -334,10 +566,11 @@ int sys_mkdirat() {
 
 int sys_mknodat() {
     Inode *ip;
-    char *path;
+    char path[MAXPATH];
     i32 dirfd, major, minor;
 
-    if (argint(0, &dirfd) < 0 || argstr(1, &path) < 0 || argint(2, &major) < 0 || argint(3, &minor))
+    if (argint(0, &dirfd) < 0 || argstr(1, path, sizeof(path)) < 0 || argint(2, &major) < 0 ||
+        argint(3, &minor))
         return -1;
 
     if (dirfd != AT_FDCWD) {
@@ -359,13 +592,16 @@ int sys_mknodat() {
 }
 
 int sys_chdir() {
-    char *path;
+    char path[MAXPATH];
     Inode *ip;
-    struct proc *curproc = thiscpu()->proc;
+    struct proc *curproc = thiscpu()->proc->group_leader;
 
+    /* Fetch it before the log operation, see copy_from_user. */
+    if (argstr(0, path, sizeof(path)) < 0)
+        return -1;
     OpContext ctx;
     bcache.begin_op(&ctx);
-    if (argstr(0, &path) < 0 || (ip = namei(path, &ctx)) == 0) {
+    if ((ip = namei(path, &ctx)) == 0) {
         bcache.end_op(&ctx);
         return -1;
     }
@@ -384,9 +620,9 @@ int sys_chdir() {
 }
 int execve(const char *path, char *const argv[], char *const envp[]);
 int sys_exec() {
-    char *p;
+    char p[MAXPATH];
     void *argv, *envp;
-    if (argstr(0, &p) < 0 || argu64(1, (u64 *)&argv) < 0 || argu64(2, (u64 *)&envp) < 0)
+    if (argstr(0, p, sizeof(p)) < 0 || argu64(1, (u64 *)&argv) < 0 || argu64(2, (u64 *)&envp) < 0)
         return -1;
     return execve(p, argv, envp);
 }
@@ -1,8 +1,16 @@
 #include <stdint.h>
+#include <sys/resource.h>
+#include <sys/times.h>
+#include <time.h>
 
+#include <common/string.h>
+#include <core/container.h>
+#include <core/futex.h>
+#include <core/physical_memory.h>
 #include <core/proc.h>
 #include <core/sched.h>
 #include <core/syscall.h>
+#include <core/timer.h>
 #include <core/trap.h>
 
 int sys_yield() {
@@ -15,46 +23,455 @@ usize sys_brk() {
     if (argint(0, (int *)&n) < 0) {
         return (usize)-1;
     }
-    usize sz = thiscpu()->proc->sz;
+    usize sz = thiscpu()->proc->mm->sz;
     if (growproc((int)n) < 0) {
         return (usize)-1;
     }
     return sz;
 }
 
+/*
+ * Flags of clone that musl uses for threads and posix_spawn. A thread
+ * shares files, directory and signal handlers with its group whether or
+ * not asked, and CLONE_VFORK doesn't suspend the parent.
+ */
+#define CLONE_SUPPORTED                                                                     \
+    (CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_VFORK | CLONE_THREAD |        \
+     CLONE_SYSVSEM | CLONE_SETTLS | CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID |            \
+     CLONE_DETACHED | CSIGNAL)
+
+/* clone(flags, stack, ptid, tls, ctid), in the argument order of arm64. */
 int sys_clone() {
-    void *childstk;
-    i32 flag;
-    if (argint(0, &flag) < 0 || argint(1, (int *)&childstk) < 0)
+    u64 flags, stack, tls;
+    int *ptid, *ctid;
+    if (argu64(0, &flags) < 0 || argu64(1, &stack) < 0 || argu64(2, (u64 *)&ptid) < 0 ||
+        argu64(3, &tls) < 0 || argu64(4, (u64 *)&ctid) < 0)
         return -1;
-    if (flag != 17) {
-        printf("sys_clone: flags other than SIGCHLD are not supported.\n");
+    if (flags & ~(u64)CLONE_SUPPORTED) {
+        printf("sys_clone: unsupported flags 0x%x.\n", flags & ~(u64)CLONE_SUPPORTED);
         return -1;
     }
-    return fork();
+    /* Sharing files and the rest is only done within a thread group. */
+    if ((flags & (CLONE_THREAD | CLONE_VM)) == CLONE_THREAD ||
+        ((flags & (CLONE_FS | CLONE_FILES | CLONE_SIGHAND)) && !(flags & CLONE_THREAD)))
+        return -1;
+    if ((flags & CLONE_PARENT_SETTID) && !in_user_writable(ptid, sizeof(*ptid)))
+        return -1;
+    return clone((int)flags, stack, ptid, tls, ctid);
 }
 
+static void _to_timeval(u64 ticks, struct timeval *tv);
+
+/*
+ * wait4(pid, wstatus, options, rusage). Processes never stop, so of the
+ * options only WNOHANG matters, and rusage only gets the times.
+ */
 int sys_wait4() {
-    i32 pid, opt;
-    int *wstatus;
-    void *rusage;
-    if (argint(0, &pid) < 0 || argint(1, (int *)&wstatus) < 0 || argint(2, &opt) < 0 ||
-        argint(3, (int *)&rusage) < 0)
+    int pid, options, status;
+    u64 wstatus, rusage, utime, stime;
+    if (argint(0, &pid) < 0 || argu64(1, &wstatus) < 0 || argint(2, &options) < 0 ||
+        argu64(3, &rusage) < 0)
+        return -1;
+    /* Fault the pages in before waiting, the child is gone after. */
+    if ((wstatus != 0 && !in_user_writable((void *)wstatus, sizeof(int))) ||
+        (rusage != 0 && !in_user_writable((void *)rusage, sizeof(struct rusage))))
         return -1;
 
-    // if (pid != -1 || wstatus != 0 || opt != 0 || rusage != 0) {
-    //     printf("sys_wait4: unimplemented. pid %d, wstatus 0x%p, opt 0x%x, rusage 0x%p\n",
-    //            pid,
-    //            wstatus,
-    //            opt,
-    //            rusage);
-    //     while (1) {}
-    //     return -1;
-    // }
-
-    return wait();
+    int child = wait(pid, options, &status, &utime, &stime);
+    if (child <= 0)
+        return child;
+    /* Another thread may have unmapped them meanwhile. */
+    if (wstatus != 0 && copy_to_user(wstatus, &status, sizeof(status)) < 0)
+        return -1;
+    if (rusage != 0) {
+        struct rusage ru;
+        memset(&ru, 0, sizeof(ru));
+        _to_timeval(utime, &ru.ru_utime);
+        _to_timeval(stime, &ru.ru_stime);
+        if (copy_to_user(rusage, &ru, sizeof(ru)) < 0)
+            return -1;
+    }
+    return child;
 }
 
 int sys_exit() {
-    exit();
+    int code;
+    if (argint(0, &code) < 0)
+        code = 0;
+    exit(EXIT_STATUS(code));
+}
+
+int sys_exit_group() {
+    int code;
+    if (argint(0, &code) < 0)
+        code = 0;
+    exit_group(EXIT_STATUS(code));
+}
+
+/*
+ * Clear *tidptr and wake a futex waiter there when the calling thread
+ * exits, which is what pthread_join waits for. Returns the thread ID.
+ */
+int sys_set_tid_address() {
+    u64 tidptr;
+    if (argu64(0, &tidptr) < 0)
+        return -1;
+    thiscpu()->proc->clear_child_tid = (int *)tidptr;
+    return thiscpu()->proc->pid;
+}
+
+/* The process ID is that of the thread group leader. */
+int sys_getpid() {
+    return thiscpu()->proc->group_leader->pid;
+}
+
+/* Set the nice value of a process. Only PRIO_PROCESS is supported. */
+int sys_setpriority() {
+    int which, who, prio;
+    struct proc *p;
+    if (argint(0, &which) < 0 || argint(1, &who) < 0 || argint(2, &prio) < 0)
+        return -1;
+    if (which != PRIO_PROCESS)
+        return -1;
+
+    acquire_spinlock(&thiscpu()->scheduler->ptable.lock);
+    p = find_proc(who);
+    if (p != NULL)
+        p->nice = MIN(MAX(prio, -20), 19);
+    release_spinlock(&thiscpu()->scheduler->ptable.lock);
+    return p == NULL ? -1 : 0;
+}
+
+/* Like the Linux system call, return 20 - nice so that it is positive. */
+int sys_getpriority() {
+    int which, who, ret = -1;
+    struct proc *p;
+    if (argint(0, &which) < 0 || argint(1, &who) < 0)
+        return -1;
+    if (which != PRIO_PROCESS)
+        return -1;
+
+    acquire_spinlock(&thiscpu()->scheduler->ptable.lock);
+    p = find_proc(who);
+    if (p != NULL)
+        ret = 20 - p->nice;
+    release_spinlock(&thiscpu()->scheduler->ptable.lock);
+    return ret;
+}
+
+/*
+ * Set the policy and priority of a process. Real-time policies need the
+ * process to be scheduled by rt_op.
+ */
+int sys_sched_setscheduler() {
+    int pid, policy, prio;
+    u64 param;
+    struct proc *p;
+    if (argint(0, &pid) < 0 || argint(1, &policy) < 0 || argu64(2, &param) < 0 ||
+        copy_from_user(&prio, param, sizeof(prio)) < 0)
+        return -1;
+    if (policy == SCHED_OTHER) {
+        if (prio != 0)
+            return -1;
+    } else if ((policy != SCHED_FIFO && policy != SCHED_RR) || prio < 1 || prio >= RT_NPRIO) {
+        return -1;
+    }
+
+    acquire_spinlock(&thiscpu()->scheduler->ptable.lock);
+    p = find_proc(pid);
+    if (p != NULL && (policy == SCHED_OTHER || p->scheduler->op == &rt_op))
+        set_sched_policy(p, policy, prio);
+    else
+        p = NULL;
+    release_spinlock(&thiscpu()->scheduler->ptable.lock);
+    return p == NULL ? -1 : 0;
+}
+
+int sys_sched_getscheduler() {
+    int pid, ret = -1;
+    struct proc *p;
+    if (argint(0, &pid) < 0)
+        return -1;
+
+    acquire_spinlock(&thiscpu()->scheduler->ptable.lock);
+    p = find_proc(pid);
+    if (p != NULL)
+        ret = p->policy;
+    release_spinlock(&thiscpu()->scheduler->ptable.lock);
+    return ret;
+}
+
+int sys_sched_getparam() {
+    int pid, prio = 0;
+    u64 param;
+    struct proc *p;
+    if (argint(0, &pid) < 0 || argu64(1, &param) < 0)
+        return -1;
+
+    acquire_spinlock(&thiscpu()->scheduler->ptable.lock);
+    p = find_proc(pid);
+    if (p != NULL)
+        prio = p->rt_priority;
+    release_spinlock(&thiscpu()->scheduler->ptable.lock);
+    if (p == NULL)
+        return -1;
+    return copy_to_user(param, &prio, sizeof(prio));
+}
+
+/* The affinity mask is a u64 to user space, with a bit for each CPU. */
+int sys_sched_setaffinity() {
+    int pid, len;
+    u64 mask, allowed;
+    struct proc *p;
+    if (argint(0, &pid) < 0 || argint(1, &len) < 0 || len < (int)sizeof(u64) ||
+        argu64(2, &mask) < 0 || copy_from_user(&allowed, mask, sizeof(allowed)) < 0)
+        return -1;
+    allowed &= CPU_MASK_ALL;
+    if (allowed == 0)
+        return -1;
+
+    acquire_spinlock(&thiscpu()->scheduler->ptable.lock);
+    p = find_proc(pid);
+    if (p != NULL)
+        set_cpus_allowed(p, allowed);
+    release_spinlock(&thiscpu()->scheduler->ptable.lock);
+    return p == NULL ? -1 : 0;
+}
+
+/* Like the Linux system call, return the size of the mask written. */
+int sys_sched_getaffinity() {
+    int pid, len;
+    u64 mask, allowed = 0;
+    struct proc *p;
+    if (argint(0, &pid) < 0 || argint(1, &len) < 0 || len < (int)sizeof(u64) ||
+        argu64(2, &mask) < 0)
+        return -1;
+
+    acquire_spinlock(&thiscpu()->scheduler->ptable.lock);
+    p = find_proc(pid);
+    if (p != NULL)
+        allowed = p->cpus_allowed;
+    release_spinlock(&thiscpu()->scheduler->ptable.lock);
+    if (p == NULL || copy_to_user(mask, &allowed, sizeof(allowed)) < 0)
+        return -1;
+    return sizeof(u64);
+}
+
+/* Copy the load balancing counters of each CPU, for the caller's scheduler. */
+int sys_myschedstat() {
+    u64 buf;
+    struct sched_stat st[NCPU];
+    struct scheduler *s = thiscpu()->proc->scheduler;
+    if (argu64(0, &buf) < 0)
+        return -1;
+    for (int i = 0; i < NCPU; i++)
+        st[i] = s->rq[i].stat;
+    return copy_to_user(buf, st, sizeof(st));
+}
+
+/*
+ * The container scheduled as the process pid of the caller's scheduler,
+ * or 0 if there is none. It is a child of the caller's container: only
+ * from there, or from the root above all, can the limits of a container
+ * be set, so that none can lift its own.
+ */
+static struct container *_child_container(int pid) {
+    struct scheduler *s = thiscpu()->scheduler;
+    struct container *c = 0;
+    acquire_spinlock(&s->ptable.lock);
+    struct proc *p = find_proc(pid);
+    if (p != NULL && p->is_scheduler)
+        c = p->cont;
+    release_spinlock(&s->ptable.lock);
+    return c != 0 && c->parent == s->cont ? c : 0;
+}
+
+/* Copy the CPU time and limits of the caller's container, which is not the root. */
+int sys_mycpustat() {
+    u64 buf;
+    struct cpu_stat st;
+    struct container *c = thiscpu()->proc->scheduler->cont;
+    if (c == root_container || argu64(0, &buf) < 0)
+        return -1;
+    get_container_cpu_stat(c, &st);
+    return copy_to_user(buf, &st, sizeof(st));
+}
+
+/* mycpulimit(pid, shares, quota_us, period_us) for the child container scheduled as pid. */
+int sys_mycpulimit() {
+    int pid;
+    u64 shares, quota_us, period_us;
+    struct container *c;
+    if (argint(0, &pid) < 0 || argu64(1, &shares) < 0 || argu64(2, &quota_us) < 0 ||
+        argu64(3, &period_us) < 0 || (c = _child_container(pid)) == 0)
+        return -1;
+    return set_container_cpu(c, shares, quota_us, period_us);
+}
+
+/* Copy the memory use of the caller's container, which is not the root. */
+int sys_mymemstat() {
+    u64 buf;
+    struct mem_stat st;
+    struct container *c = thiscpu()->proc->scheduler->cont;
+    if (c == root_container || argu64(0, &buf) < 0)
+        return -1;
+    get_container_mem_stat(c, &st);
+    return copy_to_user(buf, &st, sizeof(st));
+}
+
+/*
+ * mymemlimit(pid, bytes) for the child container scheduled as process pid,
+ * 0 bytes meaning no limit.
+ */
+int sys_mymemlimit() {
+    int pid;
+    u64 bytes;
+    struct container *c;
+    if (argint(0, &pid) < 0 || argu64(1, &bytes) < 0 || (c = _child_container(pid)) == 0)
+        return -1;
+    return set_container_mem_limit(c, bytes);
+}
+
+/* Copy the number of free blocks of each order of pages, see get_free_pages. */
+int sys_mybuddyinfo() {
+    u64 buf;
+    usize free[BUDDY_ORDERS];
+    if (argu64(0, &buf) < 0)
+        return -1;
+    get_free_pages(free);
+    return copy_to_user(buf, free, sizeof(free));
+}
+
+/*
+ * Both clocks count from boot on the generic timer, as there is no RTC
+ * to set the real time from.
+ */
+static bool _valid_clock(int clock) {
+    return clock == CLOCK_REALTIME || clock == CLOCK_MONOTONIC;
+}
+
+static int _get_timespec(int n, u64 *ticks) {
+    u64 ts;
+    struct timespec req;
+    if (argu64(n, &ts) < 0 || copy_from_user(&req, ts, sizeof(req)) < 0)
+        return -1;
+    if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000)
+        return -1;
+    *ticks = ns_to_ticks((u64)req.tv_sec * 1000000000 + (u64)req.tv_nsec);
+    return 0;
+}
+
+/* Sleeps are never interrupted, so the remaining time is not written. */
+int sys_nanosleep() {
+    u64 ticks;
+    if (_get_timespec(0, &ticks) < 0)
+        return -1;
+    return sleep_until(get_timestamp() + ticks);
+}
+
+int sys_clock_nanosleep() {
+    int clock, flags;
+    u64 ticks;
+    if (argint(0, &clock) < 0 || argint(1, &flags) < 0 || _get_timespec(2, &ticks) < 0)
+        return -1;
+    if (!_valid_clock(clock))
+        return -1;
+    return sleep_until(flags & TIMER_ABSTIME ? ticks : get_timestamp() + ticks);
+}
+
+int sys_clock_gettime() {
+    int clock;
+    u64 ts;
+    if (argint(0, &clock) < 0 || argu64(1, &ts) < 0)
+        return -1;
+    if (!_valid_clock(clock))
+        return -1;
+    u64 ns = ticks_to_ns(get_timestamp());
+    struct timespec now = {.tv_sec = (time_t)(ns / 1000000000), .tv_nsec = (long)(ns % 1000000000)};
+    return copy_to_user(ts, &now, sizeof(now));
+}
+
+static void _to_timeval(u64 ticks, struct timeval *tv) {
+    u64 us = ticks_to_ns(ticks) / 1000;
+    tv->tv_sec = (time_t)(us / 1000000);
+    tv->tv_usec = (long)(us % 1000000);
+}
+
+/* Only the times and the context switch counts are kept. */
+int sys_getrusage() {
+    int who;
+    u64 buf;
+    struct rusage ru;
+    struct proc *p = thiscpu()->proc;
+    if (argint(0, &who) < 0 || argu64(1, &buf) < 0)
+        return -1;
+    memset(&ru, 0, sizeof(ru));
+    account_time(p, &p->stime);
+    if (who == RUSAGE_SELF) {
+        _to_timeval(p->utime, &ru.ru_utime);
+        _to_timeval(p->stime, &ru.ru_stime);
+        ru.ru_nvcsw = (long)p->nvcsw;
+        ru.ru_nivcsw = (long)p->nivcsw;
+    } else if (who == RUSAGE_CHILDREN) {
+        _to_timeval(p->cutime, &ru.ru_utime);
+        _to_timeval(p->cstime, &ru.ru_stime);
+    } else {
+        return -1;
+    }
+    return copy_to_user(buf, &ru, sizeof(ru));
+}
+
+#define USER_HZ 100 /* clock_t ticks per second, as sysconf(_SC_CLK_TCK) says */
+
+static clock_t _to_clock_t(u64 ticks) {
+    return (clock_t)(ticks / (get_clock_frequency() / USER_HZ));
+}
+
+/* Returns the time since boot, truncated to an int like every result. */
+int sys_times() {
+    u64 addr;
+    struct proc *p = thiscpu()->proc;
+    if (argu64(0, &addr) < 0)
+        return -1;
+    if (addr != 0) {
+        struct tms t;
+        account_time(p, &p->stime);
+        t.tms_utime = _to_clock_t(p->utime);
+        t.tms_stime = _to_clock_t(p->stime);
+        t.tms_cutime = _to_clock_t(p->cutime);
+        t.tms_cstime = _to_clock_t(p->cstime);
+        if (copy_to_user(addr, &t, sizeof(t)) < 0)
+            return -1;
+    }
+    return (int)_to_clock_t(get_timestamp());
+}
+
+/*
+ * futex(uaddr, op, val, timeout, uaddr2, val3). The requeue operations
+ * take the number of waiters to move in place of timeout. Futexes are
+ * told apart by physical address, so FUTEX_PRIVATE_FLAG changes nothing.
+ */
+int sys_futex() {
+    u64 uaddr, timeout, uaddr2, expires = 0;
+    int op, val, val3;
+    if (argu64(0, &uaddr) < 0 || argint(1, &op) < 0 || argint(2, &val) < 0 ||
+        argu64(3, &timeout) < 0 || argu64(4, &uaddr2) < 0 || argint(5, &val3) < 0)
+        return -1;
+
+    switch (op & FUTEX_CMD_MASK) {
+        case FUTEX_WAIT:
+            /* A relative timeout, on CLOCK_MONOTONIC. */
+            if (timeout != 0) {
+                if (_get_timespec(3, &expires) < 0)
+                    return -1;
+                expires += get_timestamp();
+            }
+            return futex_wait((u32 *)uaddr, (u32)val, expires);
+        case FUTEX_WAKE: return futex_wake((u32 *)uaddr, val);
+        case FUTEX_REQUEUE:
+            return futex_requeue((u32 *)uaddr, val, (int)timeout, (u32 *)uaddr2, false, 0);
+        case FUTEX_CMP_REQUEUE:
+            return futex_requeue((u32 *)uaddr, val, (int)timeout, (u32 *)uaddr2, true, (u32)val3);
+        default: printf("sys_futex: unsupported op %d.\n", op); return -1;
+    }
 }
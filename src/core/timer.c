@@ -0,0 +1,233 @@
+#include <aarch64/intrinsic.h>
+#include <common/spinlock.h>
+#include <common/string.h>
+#include <core/console.h>
+#include <core/physical_memory.h>
+#include <core/proc.h>
+#include <core/sched.h>
+#include <core/timer.h>
+#include <driver/clock.h>
+
+/*
+ * Each CPU keeps its armed timers in a binary min-heap ordered by expiry,
+ * and programs its generic timer for the earliest one only. A CPU with
+ * nothing armed takes no timer interrupts at all. A heap starts with NTIMER
+ * slots, and doubles whenever it is full.
+ */
+static struct {
+    SpinLock lock;
+    Timer **heap; /* 2^order pages of slots */
+    int order;
+    int n;
+    Timer *running; /* Handler being called, see timer_cancel */
+} timers[NCPU];
+
+/* The preemption tick of each CPU. */
+static Timer tick[NCPU];
+
+void init_timer(Timer *timer, void (*handler)(Timer *)) {
+    timer->expires = 0;
+    timer->handler = handler;
+    timer->cpu = -1;
+    timer->index = -1;
+}
+
+static void _tick(Timer *timer);
+
+void init_timer_cpu() {
+    int cpu = (int)cpuid();
+    init_spinlock(&timers[cpu].lock, "timers");
+    timers[cpu].heap = kalloc();
+    if (timers[cpu].heap == NULL)
+        PANIC("init_timer_cpu: cannot alloc timer heap");
+    timers[cpu].order = 0;
+    timers[cpu].n = 0;
+    timers[cpu].running = NULL;
+    init_timer(&tick[cpu], _tick);
+}
+
+u64 ns_to_ticks(u64 ns) {
+    u64 freq = get_clock_frequency();
+    return ns / 1000000000 * freq + ns % 1000000000 * freq / 1000000000;
+}
+
+u64 ticks_to_ns(u64 ticks) {
+    u64 freq = get_clock_frequency();
+    return ticks / freq * 1000000000 + ticks % freq * 1000000000 / freq;
+}
+
+static void _place(Timer **heap, int i, Timer *timer) {
+    heap[i] = timer;
+    timer->index = i;
+}
+
+static void _sift_up(Timer **heap, int i) {
+    Timer *timer = heap[i];
+    while (i > 0 && heap[(i - 1) / 2]->expires > timer->expires) {
+        _place(heap, i, heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    _place(heap, i, timer);
+}
+
+static void _sift_down(Timer **heap, int n, int i) {
+    Timer *timer = heap[i];
+    for (int child; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n && heap[child + 1]->expires < heap[child]->expires)
+            child++;
+        if (heap[child]->expires >= timer->expires)
+            break;
+        _place(heap, i, heap[child]);
+    }
+    _place(heap, i, timer);
+}
+
+/* Take the timer at i off the heap of cpu. Must hold its lock. */
+static void _remove(int cpu, int i) {
+    Timer **heap = timers[cpu].heap;
+    int n = --timers[cpu].n;
+    heap[i]->index = -1;
+    if (i == n)
+        return;
+    Timer *last = heap[n];
+    _place(heap, i, last);
+    _sift_up(heap, i);
+    _sift_down(heap, n, last->index);
+}
+
+/* Double the heap of cpu. Must hold its lock. Returns -1 if out of memory. */
+static int _grow(int cpu) {
+    int order = timers[cpu].order + 1;
+    Timer **heap = kalloc_pages(order);
+    if (heap == NULL)
+        return -1;
+    memcpy(heap, timers[cpu].heap, (usize)timers[cpu].n * sizeof(Timer *));
+    kfree_pages(timers[cpu].heap, order - 1);
+    timers[cpu].heap = heap;
+    timers[cpu].order = order;
+    return 0;
+}
+
+/* Program the generic timer of this CPU for its earliest timer. */
+static void _program(int cpu) {
+    if (timers[cpu].n > 0)
+        set_clock_deadline(timers[cpu].heap[0]->expires);
+    else
+        stop_clock();
+}
+
+/*
+ * Arm timer to call its handler at expires, on this CPU. Returns -1 if
+ * the heap of this CPU is full and cannot grow.
+ */
+int timer_add(Timer *timer, u64 expires) {
+    int cpu = (int)cpuid(), ret = 0;
+    acquire_spinlock(&timers[cpu].lock);
+    if (timer->index >= 0)
+        PANIC("timer_add: timer already armed");
+    if (timers[cpu].n == (int)(NTIMER << timers[cpu].order) && _grow(cpu) < 0) {
+        ret = -1;
+    } else {
+        timer->expires = expires;
+        timer->cpu = cpu;
+        _place(timers[cpu].heap, timers[cpu].n++, timer);
+        _sift_up(timers[cpu].heap, timer->index);
+        if (timers[cpu].heap[0] == timer)
+            _program(cpu);
+    }
+    release_spinlock(&timers[cpu].lock);
+    return ret;
+}
+
+/*
+ * Disarm timer. Returns false if it was not armed. If its handler is
+ * running, wait for it to return, so that the timer may be freed after.
+ */
+bool timer_cancel(Timer *timer) {
+    int cpu = timer->cpu;
+    bool armed;
+    if (cpu < 0)
+        return false;
+    acquire_spinlock(&timers[cpu].lock);
+    while (timers[cpu].running == timer) {
+        release_spinlock(&timers[cpu].lock);
+        arch_yield();
+        acquire_spinlock(&timers[cpu].lock);
+    }
+    armed = timer->index >= 0;
+    if (armed)
+        _remove(cpu, timer->index);
+    release_spinlock(&timers[cpu].lock);
+    /* Another CPU's hardware may fire early now, which does no harm. */
+    return armed;
+}
+
+/* The clock handler: run the handlers of expired timers of this CPU. */
+void timer_interrupt() {
+    int cpu = (int)cpuid();
+    acquire_spinlock(&timers[cpu].lock);
+    while (timers[cpu].n > 0 && timers[cpu].heap[0]->expires <= get_timestamp()) {
+        Timer *timer = timers[cpu].heap[0];
+        _remove(cpu, 0);
+        timers[cpu].running = timer;
+        release_spinlock(&timers[cpu].lock);
+        timer->handler(timer);
+        acquire_spinlock(&timers[cpu].lock);
+        timers[cpu].running = NULL;
+    }
+    _program(cpu);
+    release_spinlock(&timers[cpu].lock);
+}
+
+/* The slice is used up: ask for a switch at the end of the trap. */
+static void _tick(Timer *timer) {
+    (void)timer;
+    thiscpu()->need_resched = true;
+}
+
+/*
+ * Restart the tick of this CPU to expire slice ns from now, or stop it if
+ * slice is 0. The scheduler calls this for each process it switches to.
+ */
+void start_tick(u64 slice) {
+    Timer *timer = &tick[cpuid()];
+    timer_cancel(timer);
+    if (slice > 0)
+        timer_add(timer, get_timestamp() + ns_to_ticks(slice));
+}
+
+/* Stop the tick of this CPU, e.g. because it has nothing to preempt. */
+void stop_tick() {
+    timer_cancel(&tick[cpuid()]);
+}
+
+typedef struct {
+    Timer timer;
+    SpinLock lock;
+} Sleeper;
+
+static void _wake_sleeper(Timer *timer) {
+    Sleeper *sleeper = container_of(timer, Sleeper, timer);
+    /* Wait for the sleeper to be on the wait queue. */
+    wait_spinlock(&sleeper->lock);
+    wakeup(sleeper);
+}
+
+/*
+ * Put the current process to sleep until the timestamp expires. Returns
+ * -1, without sleeping, if there is no memory to arm a timer.
+ */
+int sleep_until(u64 expires) {
+    Sleeper sleeper;
+    init_timer(&sleeper.timer, _wake_sleeper);
+    init_spinlock(&sleeper.lock, "sleeper");
+
+    if (timer_add(&sleeper.timer, expires) < 0)
+        return -1;
+    acquire_spinlock(&sleeper.lock);
+    while (get_timestamp() < expires)
+        sleep(&sleeper, &sleeper.lock);
+    release_spinlock(&sleeper.lock);
+    timer_cancel(&sleeper.timer);
+    return 0;
+}
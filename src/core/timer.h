@@ -0,0 +1,30 @@
+#pragma once
+
+#include <aarch64/mmu.h>
+#include <common/defines.h>
+
+/*
+ * A one-shot timer, armed on the heap of the CPU that adds it. Expiry
+ * times are absolute timestamps of the generic timer (cntpct_el0).
+ */
+typedef struct Timer {
+    u64 expires;
+    void (*handler)(struct Timer *this); /* Called with no lock held */
+    int cpu;                             /* Heap it is armed on */
+    int index;                           /* Position in that heap, -1 if not armed */
+} Timer;
+
+#define NTIMER (PAGE_SIZE / sizeof(Timer *)) /* armed timers per CPU to start with */
+
+void init_timer(Timer *timer, void (*handler)(Timer *));
+void init_timer_cpu();
+int timer_add(Timer *timer, u64 expires);
+bool timer_cancel(Timer *timer);
+void timer_interrupt();
+
+void start_tick(u64 slice);
+void stop_tick();
+
+u64 ns_to_ticks(u64 ns);
+u64 ticks_to_ns(u64 ticks);
+int sleep_until(u64 expires);
@@ -1,9 +1,12 @@
 #include <aarch64/arm.h>
 #include <aarch64/intrinsic.h>
 #include <core/console.h>
+#include <core/fpsimd.h>
 #include <core/proc.h>
+#include <core/sched.h>
 #include <core/syscall.h>
 #include <core/trap.h>
+#include <core/virtual_memory.h>
 #include <driver/clock.h>
 #include <driver/interrupt.h>
 #include <driver/irq.h>
@@ -20,6 +23,9 @@ void trap_global_handler(Trapframe *frame) {
     u64 iss = esr & ESR_ISS_MASK;
     u64 ir = esr & ESR_IR_MASK;
 
+    /* Charge the time since the last return to user space. */
+    account_time(thiscpu()->proc, &thiscpu()->proc->utime);
+
     // u32 src = get32(IRQ_SRC_CORE(cpuid()));
 
     switch (ec) {
@@ -30,6 +36,11 @@ void trap_global_handler(Trapframe *frame) {
                 interrupt_global_handler();
         } break;
 
+        case ESR_EC_FPSIMD: {
+            arch_reset_esr();
+            fpsimd_trap();
+        } break;
+
         case ESR_EC_SVC64: {
             arch_reset_esr();
             frame->x[0] = syscall_dispatch(frame);
@@ -38,11 +49,30 @@ void trap_global_handler(Trapframe *frame) {
             (void)iss;
         } break;
 
+        case ESR_EC_DABORT:
+        case ESR_EC_IABORT: {
+            arch_reset_esr();
+            struct proc *p = thiscpu()->proc;
+            u64 far = arch_get_far();
+            bool write = ec == ESR_EC_DABORT && (iss & ESR_ISS_WNR);
+            if (uvm_fault(p, far, write) < 0) {
+                printf("pid %d %s: segmentation fault at 0x%p\n", p->pid, p->name, far);
+                exit_group(KILL_STATUS(SIGSEGV));
+            }
+        } break;
+
         default: {
             // TODO: should exit current process here.
             // exit(1);
         }
     }
+
+    /* Traps only come from user space, so this is a safe point to exit or switch. */
+    if (thiscpu()->proc->killed)
+        exit(KILL_STATUS(SIGKILL));
+    if (thiscpu()->need_resched)
+        preempt();
+    account_time(thiscpu()->proc, &thiscpu()->proc->stime);
 }
 
 NO_RETURN void trap_error_handler(u64 type) {
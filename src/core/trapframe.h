@@ -7,6 +7,5 @@ typedef struct {
     u64 x[31];
     u64 _padding;
 
-    // TODO: this is a dirty hack, since musl's `memset` requires only SIMD register `q0`.
-    u64 q0[2];
+    // FP/SIMD registers are not saved on traps, see core/fpsimd.c.
 } Trapframe;
@@ -1,14 +1,20 @@
+#include <sys/mman.h>
+
 #include <aarch64/intrinsic.h>
 #include <common/defines.h>
 #include <common/string.h>
+#include <core/arena.h>
 #include <core/console.h>
 #include <core/physical_memory.h>
+#include <core/proc.h>
 #include <core/virtual_memory.h>
+#include <fs/file.h>
 
 /* For simplicity, we only support 4k pages in user pgdir. */
 
 extern PTEntries kpgdir;
 VirtualMemoryTable vmt;
+static Arena mm_arena;
 
 PTEntriesPtr pgdir_init() {
     return vmt.pgdir_init();
@@ -75,51 +81,56 @@ static PTEntriesPtr my_pgdir_walk(PTEntriesPtr pgdir, void *vak, int alloc) {
         if (!(pagetable[page_index] & PTE_VALID)) {
             void *p;
             /* FIXME Free allocated pages and restore modified pgt */
-            if (alloc && (p = kalloc())) {
-                memset(p, 0, PAGE_SIZE);
-                pagetable[page_index] = K2P(p) | PTE_TABLE;
-            }
-            // else {
-            //     PANIC("my_pgdir_walk: No free page.");
-            // }
+            if (!alloc || !(p = kalloc()))
+                return NULL;
+            memset(p, 0, PAGE_SIZE);
+            pagetable[page_index] = K2P(p) | PTE_TABLE;
         }
         pagetable = (PTEntriesPtr)(P2K(PTE_ADDRESS(pagetable[page_index])));
     }
     return &pagetable[virtual_address_tag & 0x1FF];
 }
 
-/* Fork a process's page table. */
+void recur_vm_free(PTEntriesPtr pgdir, int level);
+
+/*
+ * Fork a process's page table. The copies of private pages are charged
+ * to the container of the current process. Returns NULL, having freed
+ * what was copied, if out of memory.
+ */
 
 static PTEntriesPtr recur_uvm_copy(PTEntriesPtr pgdir, int level) {
     PTEntriesPtr newpgdir = my_pgdir_init();
-    // if (!newpgdir) {
-    //     PANIC("recur_uvm_copy: No page to alloc.");
-    // }
+    if (!newpgdir)
+        return NULL;
     if (level < 3) {
         for (int i = 0; i < 512; i++) {
             if (pgdir[i] & PTE_VALID) {
                 // assert(pgdir[i] & PTE_TABLE);
                 PTEntriesPtr page_table = (PTEntriesPtr)(P2K(PTE_ADDRESS(pgdir[i])));
                 PTEntriesPtr page_copy = recur_uvm_copy(page_table, level + 1);
-                // if (!page_copy) {
-                //     PANIC("recur_uvm_copy: No page to alloc.")
-                // }
+                if (!page_copy) {
+                    recur_vm_free(newpgdir, level);
+                    return NULL;
+                }
                 newpgdir[i] = K2P(page_copy) | PTE_FLAGS(pgdir[i]);
             }
         }
     } else {
         for (int i = 0; i < 512; i++) {
-            if (pgdir[i] & PTE_VALID) {
+            /* Pages of mapped files are shared, not copied. */
+            if ((pgdir[i] & PTE_VALID) && !(pgdir[i] & PTE_FILE)) {
                 // assert(pgdir[i] & PTE_TABLE);
                 // assert(pgdir[i] & PTE_PAGE);
                 // assert(pgdir[i] & PTE_USER);
                 // assert(pgdir[i] & PTE_NORMAL);
                 // assert(PTE_ADDRESS(pgdir[i]) < KERNBASE);
                 PTEntriesPtr page_content_ptr = (PTEntriesPtr)(P2K(PTE_ADDRESS(pgdir[i])));
-                PTEntriesPtr page_copy = kalloc();
-                // if (!page_copy) {
-                //     PANIC("recur_uvm_copy: No page to alloc.")
-                // }
+                PTEntriesPtr page_copy = kalloc_charged();
+                if (!page_copy) {
+                    recur_vm_free(newpgdir, level);
+                    return NULL;
+                }
                 memmove(page_copy, page_content_ptr, PAGE_SIZE);
                 newpgdir[i] = K2P(page_copy) | PTE_FLAGS(pgdir[i]);
             }
@@ -146,7 +157,7 @@ void recur_vm_free(PTEntriesPtr pgdir, int level) {
         kfree(pgdir);
     } else {
         for (int i = 0; i < 512; i++) {
-            if (pgdir[i] & PTE_VALID) {
+            if ((pgdir[i] & PTE_VALID) && !(pgdir[i] & PTE_FILE)) {
                 PTEntriesPtr page_content_ptr = (PTEntriesPtr)(P2K(PTE_ADDRESS(pgdir[i])));
                 kfree(page_content_ptr);
             }
@@ -186,7 +197,8 @@ int my_uvm_map(PTEntriesPtr pgdir, void *va, usize sz, u64 pa) {
 /*
  * Allocate page tables and physical memory to grow process
  * from oldsz to newsz, which need not be page aligned.
- * Stack size stksz should be page aligned.
+ * Stack size stksz should be page aligned. The memory is charged
+ * to the container of the current process.
  * Returns new size or 0 on error.
  */
 
@@ -198,7 +210,7 @@ int my_uvm_alloc(PTEntriesPtr pgdir, usize base, usize stksz, usize oldsz, usize
     }
 
     for (usize a = round_up(oldsz, PAGE_SIZE); a < newsz; a += PAGE_SIZE) {
-        void *page = kalloc();
+        void *page = kalloc_charged();
         if (!page) {
             printf("my_uvm_alloc: kalloc failed.");
             uvm_dealloc(pgdir, base, a - PAGE_SIZE, oldsz);
@@ -222,24 +234,48 @@ int my_uvm_alloc(PTEntriesPtr pgdir, usize base, usize stksz, usize oldsz, usize
  * process size.  Returns the new process size.
  */
 
+/*
+ * Threads of an mm may run on other CPUs, whose TLBs can still reach a
+ * page after its PTE is cleared. Unmapped pages are thus collected a
+ * batch at a time, and freed only after the TLBs are flushed.
+ */
+#define UNMAP_BATCH 16
+
+static void _free_unmapped(void **pages, int n) {
+    if (n == 0)
+        return;
+    arch_tlbi_vmalle1is();
+    for (int i = 0; i < n; i++)
+        kfree(pages[i]);
+}
+
 int my_uvm_dealloc(PTEntriesPtr pgdir, usize base, usize oldsz, usize newsz) {
+    void *pages[UNMAP_BATCH];
+    int n = 0;
     if (newsz >= oldsz || newsz < base)
         return (int)oldsz;
 
     for (usize a = round_up(newsz, PAGE_SIZE); a < oldsz; a += PAGE_SIZE) {
         PTEntriesPtr page_content_ptr = pgdir_walk(pgdir, (void *)a, 0);
-        if (page_content_ptr && (*page_content_ptr & PTE_VALID)) {
+        /* Pages of mapped segments belong to their regions. */
+        if (page_content_ptr && (*page_content_ptr & PTE_VALID) &&
+            !(*page_content_ptr & PTE_FILE)) {
             u64 pa = PTE_ADDRESS(*page_content_ptr);
             // if (!pa) {
             //     PANIC("GG");
             // }
-            kfree((void *)P2K(pa));
             *page_content_ptr = 0;
+            pages[n++] = (void *)P2K(pa);
+            if (n == UNMAP_BATCH) {
+                _free_unmapped(pages, n);
+                n = 0;
+            }
         }
         // else {
         //     PANIC("attempt to free unallocated page");
         // }
     }
+    _free_unmapped(pages, n);
 
     return (int)newsz;
 }
@@ -266,7 +302,7 @@ int my_copyout(PTEntriesPtr pgdir, void *va, void *p, usize len) {
         if (*page_content_ptr & PTE_VALID) {
             page = (void *)(P2K(PTE_ADDRESS(*page_content_ptr)));
         } else {
-            page = kalloc();
+            page = kalloc_charged();
             if (!page) {
                 printf("my_copyout: kalloc failed.");
                 return -1;
@@ -288,6 +324,494 @@ int my_copyout(PTEntriesPtr pgdir, void *va, void *p, usize len) {
     return 0;
 }
 
+/*
+ * Pages of mapped files come from the page cache of the inode and
+ * are pinned while mapped. Private mappings share them until the
+ * first write, which copies the page. A shared mapping that has
+ * written a page writes it back when the page is unmapped.
+ */
+
+/* Pin the cached page of r at offset. */
+static u8 *_get_file_page(MmapRegion *r, usize offset) {
+    Inode *ip = r->file->ip;
+    inodes.lock(ip);
+    u8 *page = inodes.get_page(ip, offset / PAGE_SIZE);
+    inodes.unlock(ip);
+    return page;
+}
+
+static void _put_file_page(MmapRegion *r, usize offset) {
+    Inode *ip = r->file->ip;
+    inodes.lock(ip);
+    inodes.put_page(ip, offset / PAGE_SIZE);
+    inodes.unlock(ip);
+}
+
+static MmapRegion *_find_region(struct mm *mm, u64 va) {
+    for (MmapRegion *r = mm->mmaps; r < mm->mmaps + NMMAP; r++) {
+        if (r->start <= va && va < r->end)
+            return r;
+    }
+    return NULL;
+}
+
+static MmapRegion *_free_region(struct mm *mm) {
+    for (MmapRegion *r = mm->mmaps; r < mm->mmaps + NMMAP; r++) {
+        if (r->start == r->end)
+            return r;
+    }
+    return NULL;
+}
+
+/*
+ * Release pages of r unmapped from va[i] with PTE pte[i], flushing the
+ * TLBs first, see UNMAP_BATCH.
+ */
+static void _release_unmapped(MmapRegion *r, u64 *va, u64 *pte, int n) {
+    if (n == 0)
+        return;
+    arch_tlbi_vmalle1is();
+    for (int i = 0; i < n; i++) {
+        void *page = (void *)P2K(PTE_ADDRESS(pte[i]));
+        if (pte[i] & PTE_FILE) {
+            /* A writable PTE of a shared mapping means a dirty page. */
+            usize offset = r->offset + (va[i] - r->start);
+            if ((r->flags & MAP_SHARED) && !(pte[i] & PTE_RO))
+                filepageout(r->file->ip, page, offset);
+            _put_file_page(r, offset);
+        } else {
+            kfree(page);
+        }
+    }
+}
+
+/* Unmap the pages of r in [start, end) from pgdir. */
+static void _unmap_pages(PTEntriesPtr pgdir, MmapRegion *r, u64 start, u64 end) {
+    u64 vas[UNMAP_BATCH], ptes[UNMAP_BATCH];
+    int n = 0;
+    for (u64 va = start; va < end; va += PAGE_SIZE) {
+        PTEntriesPtr pte = pgdir_walk(pgdir, (void *)va, 0);
+        if (!pte || !(*pte & PTE_VALID))
+            continue;
+
+        vas[n] = va;
+        ptes[n++] = *pte;
+        *pte = 0;
+        if (n == UNMAP_BATCH) {
+            _release_unmapped(r, vas, ptes, n);
+            n = 0;
+        }
+    }
+    _release_unmapped(r, vas, ptes, n);
+}
+
+/* Find a free range of len bytes, preferring hint. Returns 0 if none. */
+static u64 _find_free_range(struct mm *mm, u64 hint, usize len) {
+    u64 start = MMAP_BASE;
+    if (hint % PAGE_SIZE == 0 && MMAP_BASE <= hint && hint < MMAP_TOP)
+        start = hint;
+
+    for (int retry = 0; retry < 2; retry++) {
+        bool moved = true;
+        while (moved && start + len <= MMAP_TOP) {
+            moved = false;
+            for (MmapRegion *r = mm->mmaps; r < mm->mmaps + NMMAP; r++) {
+                if (r->start < r->end && r->start < start + len && start < r->end) {
+                    start = r->end;
+                    moved = true;
+                }
+            }
+        }
+        if (!moved && start + len <= MMAP_TOP)
+            return start;
+        start = MMAP_BASE;
+    }
+    return 0;
+}
+
+/* See uvm_munmap. Must hold the lock of mm. */
+static int _munmap(struct mm *mm, u64 addr, usize len) {
+    if (addr % PAGE_SIZE != 0 || len == 0 || addr + len < addr)
+        return -1;
+    u64 end = round_up(addr + len, PAGE_SIZE);
+
+    MmapRegion *r = _find_region(mm, addr), *split = NULL;
+    if (r && r->start < addr && end < r->end && !(split = _free_region(mm)))
+        return -1;
+
+    for (r = mm->mmaps; r < mm->mmaps + NMMAP; r++) {
+        if (r->start == r->end || r->end <= addr || end <= r->start)
+            continue;
+
+        u64 start0 = MAX(r->start, addr), end0 = MIN(r->end, end);
+        _unmap_pages(mm->pgdir, r, start0, end0);
+
+        if (r->start < start0 && end0 < r->end) {
+            *split = *r;
+            split->start = end0;
+            split->offset += end0 - r->start;
+            split->file = r->file ? filedup(r->file) : NULL;
+            r->end = start0;
+        } else if (r->start < start0) {
+            r->end = start0;
+        } else if (end0 < r->end) {
+            r->offset += end0 - r->start;
+            r->start = end0;
+        } else {
+            if (r->file)
+                fileclose(r->file);
+            memset(r, 0, sizeof(*r));
+        }
+    }
+    return 0;
+}
+
+/*
+ * Whether a region slot is left once [addr, end) is unmapped, counting
+ * the slots of the regions it covers, less one if it splits a region.
+ */
+static bool _slot_after_munmap(struct mm *mm, u64 addr, u64 end) {
+    int nr_free = 0;
+    for (MmapRegion *r = mm->mmaps; r < mm->mmaps + NMMAP; r++) {
+        if (r->start == r->end || (addr <= r->start && r->end <= end))
+            nr_free++;
+        else if (r->start < addr && end < r->end)
+            nr_free--;
+    }
+    return nr_free > 0;
+}
+
+/* See uvm_mmap. Must hold the lock of mm. */
+static u64 _mmap(struct mm *mm, u64 addr, usize len, int prot, int flags, struct file *f,
+                 usize off) {
+    int type = flags & (MAP_SHARED | MAP_PRIVATE);
+    if (len == 0 || len > MMAP_TOP - MMAP_BASE || off % PAGE_SIZE != 0)
+        return (u64)-1;
+    if (type != MAP_SHARED && type != MAP_PRIVATE)
+        return (u64)-1;
+
+    if (flags & MAP_ANONYMOUS) {
+        if (type == MAP_SHARED) {
+            printf("uvm_mmap: shared anonymous mapping unimplemented.\n");
+            return (u64)-1;
+        }
+        f = NULL;
+        off = 0;
+    } else {
+        if (!f || f->type != FD_INODE || f->ip->entry.type != INODE_REGULAR || !f->readable)
+            return (u64)-1;
+        if (type == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+            return (u64)-1;
+    }
+
+    len = round_up(len, PAGE_SIZE);
+    if (flags & MAP_FIXED) {
+        if (addr % PAGE_SIZE != 0 || addr < MMAP_BASE || addr + len > MMAP_TOP)
+            return (u64)-1;
+        /* Fail before unmapping anything if the new region has no slot. */
+        if (!_slot_after_munmap(mm, addr, addr + len) || _munmap(mm, addr, len) < 0)
+            return (u64)-1;
+    } else if ((addr = _find_free_range(mm, addr, len)) == 0) {
+        return (u64)-1;
+    }
+
+    MmapRegion *r = _free_region(mm);
+    if (!r)
+        return (u64)-1;
+
+    r->start = addr;
+    r->end = addr + len;
+    r->prot = prot;
+    r->flags = flags;
+    r->file = f ? filedup(f) : NULL;
+    r->offset = off;
+    return addr;
+}
+
+/*
+ * Map len bytes of f starting at off, or anonymous memory if
+ * flags has MAP_ANONYMOUS, into the address space of p. Pages are
+ * mapped on first access. Returns the address of the mapping or
+ * (u64)-1 on error.
+ */
+u64 uvm_mmap(struct proc *p, u64 addr, usize len, int prot, int flags, struct file *f, usize off) {
+    acquire_sleeplock(&p->mm->lock);
+    addr = _mmap(p->mm, addr, len, prot, flags, f, off);
+    release_sleeplock(&p->mm->lock);
+    return addr;
+}
+
+/*
+ * Remove the mappings of p in [addr, addr + len). A region partially
+ * covered is trimmed, or split in two if the range is inside it.
+ * Returns -1 if the arguments are invalid or a split needs a region
+ * slot and there is none.
+ */
+int uvm_munmap(struct proc *p, u64 addr, usize len) {
+    acquire_sleeplock(&p->mm->lock);
+    int r = _munmap(p->mm, addr, len);
+    release_sleeplock(&p->mm->lock);
+    return r;
+}
+
+/* Remove all mappings of mm. Must hold its lock. */
+static void _munmap_all(struct mm *mm) {
+    for (MmapRegion *r = mm->mmaps; r < mm->mmaps + NMMAP; r++) {
+        if (r->start == r->end)
+            continue;
+        _unmap_pages(mm->pgdir, r, r->start, r->end);
+        if (r->file)
+            fileclose(r->file);
+        memset(r, 0, sizeof(*r));
+    }
+}
+
+/* The entry for page pa of r, with the access allowed by its prot. */
+static INLINE u64 _region_pte(MmapRegion *r, u64 pa) {
+    u64 pte = pa | PTE_USER_DATA | PTE_PXN;
+    if (!(r->prot & PROT_WRITE))
+        pte |= PTE_RO;
+    if (!(r->prot & PROT_EXEC))
+        pte |= PTE_UXN;
+    return pte;
+}
+
+/* See uvm_fault. Must hold the lock of mm. */
+static int _fault(struct mm *mm, u64 va, bool write) {
+    MmapRegion *r = _find_region(mm, va);
+    if (!r || !(r->prot & (PROT_READ | PROT_WRITE | PROT_EXEC)))
+        return -1;
+    if (write && !(r->prot & PROT_WRITE))
+        return -1;
+
+    va = round_down(va, PAGE_SIZE);
+    usize offset = r->offset + (va - r->start);
+    if (r->file && offset / PAGE_SIZE >= INODE_MAX_PAGES)
+        return -1;
+
+    PTEntriesPtr pte = pgdir_walk(mm->pgdir, (void *)va, 1);
+    if (!pte)
+        return -1;
+
+    bool shared = (r->flags & MAP_SHARED) != 0;
+    if (*pte & PTE_VALID) {
+        if (!write || !(*pte & PTE_RO))
+            return 0;
+
+        /* Write to a file page mapped read-only. */
+        if (shared) {
+            *pte &= ~(u64)PTE_RO;
+        } else {
+            void *page = kalloc_charged();
+            if (!page)
+                return -1;
+            memmove(page, (void *)P2K(PTE_ADDRESS(*pte)), PAGE_SIZE);
+            *pte = _region_pte(r, K2P(page));
+            _put_file_page(r, offset);
+        }
+        arch_tlbi_vmalle1is();
+        return 0;
+    }
+
+    if (!r->file) {
+        void *page = kalloc_charged();
+        if (!page)
+            return -1;
+        memset(page, 0, PAGE_SIZE);
+        *pte = _region_pte(r, K2P(page));
+        return 0;
+    }
+
+    u8 *data = _get_file_page(r, offset);
+    if (!data)
+        return -1;
+    if (!shared && write) {
+        void *page = kalloc_charged();
+        if (page)
+            memmove(page, data, PAGE_SIZE);
+        _put_file_page(r, offset);
+        if (!page)
+            return -1;
+        *pte = _region_pte(r, K2P(page));
+        return 0;
+    }
+    /* Read-only until written: to find dirty shared pages, and to copy private ones. */
+    *pte = _region_pte(r, K2P(data)) | PTE_FILE | (write ? 0 : PTE_RO);
+    return 0;
+}
+
+/*
+ * Handle a page fault of p at va. Returns 0 if the page is mapped
+ * with the required access, or -1 if va is not in a region or the
+ * access is not permitted. Threads sharing the address space fault
+ * one at a time, so a page is mapped only once.
+ */
+int uvm_fault(struct proc *p, u64 va, bool write) {
+    acquire_sleeplock(&p->mm->lock);
+    int r = _fault(p->mm, va, write);
+    release_sleeplock(&p->mm->lock);
+    return r;
+}
+
+/*
+ * Fault in the pages of [va, va + len) that lie in regions of p, so
+ * that the kernel can access them. Pages outside the mmap area and
+ * all regions are left to the caller to check. Returns -1 if a page
+ * can not be mapped with the required access.
+ */
+int uvm_prefault(struct proc *p, u64 va, usize len, bool write) {
+    if (va + len < va)
+        return -1;
+    u64 end = MAX(va + len, va + 1);
+    int r = 0;
+    acquire_sleeplock(&p->mm->lock);
+    for (u64 a = round_down(va, PAGE_SIZE); r == 0 && a < end; a += PAGE_SIZE) {
+        bool in_region = _find_region(p->mm, a) != NULL;
+        if (!in_region && MMAP_BASE <= a && a < MMAP_TOP)
+            r = -1;
+        else if (in_region && _fault(p->mm, a, write) < 0)
+            r = -1;
+    }
+    release_sleeplock(&p->mm->lock);
+    return r;
+}
+
+/*
+ * The entry of the user page at va, faulted in first if it is in a
+ * region, or NULL if it is not mapped with the required access. Must
+ * hold the lock of mm.
+ */
+static PTEntriesPtr _user_pte(struct mm *mm, u64 va, bool write) {
+    if (va >= USPACE_TOP)
+        return NULL;
+    if (_find_region(mm, va) != NULL && _fault(mm, va, write) < 0)
+        return NULL;
+    PTEntriesPtr pte = pgdir_walk(mm->pgdir, (void *)va, 0);
+    if (!pte || !(*pte & PTE_VALID) || !(*pte & PTE_USER) || (write && (*pte & PTE_RO)))
+        return NULL;
+    return pte;
+}
+
+/*
+ * Copy len bytes between buf and the memory of p at va, into that
+ * memory if write. The pages are reached through the kernel mapping,
+ * with the lock of the mm held throughout, so another thread can not
+ * unmap them meanwhile. Returns -1 if a page is not mapped with the
+ * required access, in which case a part may have been copied.
+ */
+int uvm_access(struct proc *p, u64 va, void *buf, usize len, bool write) {
+    if (va + len < va)
+        return -1;
+    int r = 0;
+    acquire_sleeplock(&p->mm->lock);
+    while (len > 0) {
+        PTEntriesPtr pte = _user_pte(p->mm, va, write);
+        if (!pte) {
+            r = -1;
+            break;
+        }
+        usize n = MIN(len, PAGE_SIZE - va % PAGE_SIZE);
+        void *page = (void *)P2K(PTE_ADDRESS(*pte) + va % PAGE_SIZE);
+        if (write)
+            memmove(page, buf, n);
+        else
+            memmove(buf, page, n);
+        va += n;
+        buf += n;
+        len -= n;
+    }
+    release_sleeplock(&p->mm->lock);
+    return r;
+}
+
+/*
+ * The physical address of the byte of p at va, or 0 if it is not mapped
+ * with the required access. Copy-on-write pages are copied first when
+ * write, so that the address stays the same.
+ */
+u64 uvm_phys(struct proc *p, u64 va, bool write) {
+    acquire_sleeplock(&p->mm->lock);
+    PTEntriesPtr pte = _user_pte(p->mm, va, write);
+    u64 pa = pte ? PTE_ADDRESS(*pte) + va % PAGE_SIZE : 0;
+    release_sleeplock(&p->mm->lock);
+    return pa;
+}
+
+/* A new address space using pgdir, or NULL if pgdir is. */
+static struct mm *_mm_create(PTEntriesPtr pgdir) {
+    if (pgdir == NULL)
+        return NULL;
+    struct mm *mm = alloc_object(&mm_arena);
+    if (mm == NULL) {
+        vm_free(pgdir);
+        return NULL;
+    }
+    memset(mm, 0, sizeof(*mm));
+    init_rc(&mm->ref);
+    increment_rc(&mm->ref);
+    init_rc(&mm->users);
+    increment_rc(&mm->users);
+    init_sleeplock(&mm->lock, "mm");
+    mm->pgdir = pgdir;
+    return mm;
+}
+
+/* An empty address space, used by one process. */
+struct mm *mm_alloc() {
+    return _mm_create(pgdir_init());
+}
+
+/*
+ * A copy of mm, for fork. Private pages are copied by uvm_copy; shared
+ * file pages are faulted in again by the child.
+ */
+struct mm *mm_copy(struct mm *mm) {
+    acquire_sleeplock(&mm->lock);
+    struct mm *copy = _mm_create(uvm_copy(mm->pgdir));
+    if (copy != NULL) {
+        copy->sz = mm->sz;
+        copy->base = mm->base;
+        copy->stksz = mm->stksz;
+        for (int i = 0; i < NMMAP; i++) {
+            copy->mmaps[i] = mm->mmaps[i];
+            if (copy->mmaps[i].file)
+                copy->mmaps[i].file = filedup(copy->mmaps[i].file);
+        }
+    }
+    release_sleeplock(&mm->lock);
+    return copy;
+}
+
+/* Use mm in one more process. */
+struct mm *mm_share(struct mm *mm) {
+    increment_rc(&mm->ref);
+    increment_rc(&mm->users);
+    return mm;
+}
+
+/*
+ * The caller stops running in mm, as it exits or execs. The last one
+ * to do so removes the regions, which may write back shared pages.
+ */
+void mm_release(struct mm *mm) {
+    if (!decrement_rc(&mm->users))
+        return;
+    acquire_sleeplock(&mm->lock);
+    _munmap_all(mm);
+    release_sleeplock(&mm->lock);
+}
+
+/*
+ * Drop a reference to mm, and free it with its page table if it was the
+ * last one. It doesn't sleep, so may be called with a spinlock held.
+ */
+void mm_put(struct mm *mm) {
+    if (!decrement_rc(&mm->ref))
+        return;
+    vm_free(mm->pgdir);
+    free_object(mm);
+}
+
 void virtual_memory_init(VirtualMemoryTable *vmt_ptr) {
     vmt_ptr->pgdir_init = my_pgdir_init;
     vmt_ptr->pgdir_walk = my_pgdir_walk;
@@ -300,7 +824,9 @@ void virtual_memory_init(VirtualMemoryTable *vmt_ptr) {
 }
 
 void init_virtual_memory() {
+    ArenaPageAllocator allocator = {.allocate = kalloc, .free = kfree};
     virtual_memory_init(&vmt);
+    init_arena(&mm_arena, sizeof(struct mm), allocator);
 }
 
 void vm_test() {
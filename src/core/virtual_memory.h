@@ -1,10 +1,46 @@
 #pragma once
 
 #include <aarch64/mmu.h>
+#include <common/rc.h>
+#include <core/sleeplock.h>
 #include <driver/base.h>
 
 #define USPACE_TOP 0x0001000000000000
 
+/*
+ * mmap regions live in [MMAP_BASE, MMAP_TOP). Syscalls return int,
+ * so a mapped address must stay below 2^31.
+ */
+#define MMAP_BASE 0x40000000
+#define MMAP_TOP  0x80000000
+#define NMMAP     16 /* mmap regions per process */
+
+struct file;
+struct proc;
+
+/* A region created by mmap. Unused when start == end. */
+typedef struct {
+    u64 start, end;
+    int prot, flags;
+    struct file *file; /* NULL for anonymous mappings */
+    usize offset;      /* file offset of start */
+} MmapRegion;
+
+/*
+ * A user address space. Processes created by clone with CLONE_VM, threads
+ * in particular, share it. users counts the processes running in it, and
+ * the last one to leave unmaps its regions; ref also counts zombies, which
+ * keep the page table until they are off their kernel stack.
+ */
+struct mm {
+    RefCount ref, users;
+    SleepLock lock;          /* Serializes changes to sz and the regions */
+    PTEntriesPtr pgdir;      /* Page table */
+    u64 sz, base;            /* Program image and heap: [base, sz) */
+    u64 stksz;               /* Stack: [USPACE_TOP - stksz, USPACE_TOP) */
+    MmapRegion mmaps[NMMAP]; /* Regions created by mmap */
+};
+
 /*
  * uvm stands user vitual memory.
  */
@@ -29,6 +65,17 @@ int uvm_alloc(PTEntriesPtr pgdir, usize base, usize stksz, usize oldsz, usize ne
 int uvm_dealloc(PTEntriesPtr pgdir, usize base, usize oldsz, usize newsz);
 void uvm_switch(PTEntriesPtr pgdir);
 int copyout(PTEntriesPtr pgdir, void *va, void *p, usize len);
+u64 uvm_mmap(struct proc *p, u64 addr, usize len, int prot, int flags, struct file *f, usize off);
+int uvm_munmap(struct proc *p, u64 addr, usize len);
+int uvm_fault(struct proc *p, u64 va, bool write);
+int uvm_prefault(struct proc *p, u64 va, usize len, bool write);
+int uvm_access(struct proc *p, u64 va, void *buf, usize len, bool write);
+u64 uvm_phys(struct proc *p, u64 va, bool write);
+struct mm *mm_alloc();
+struct mm *mm_copy(struct mm *mm);
+struct mm *mm_share(struct mm *mm);
+void mm_release(struct mm *mm);
+void mm_put(struct mm *mm);
 void virtual_memory_init(VirtualMemoryTable *vmt_ptr);
 void init_virtual_memory();
 void vm_test();
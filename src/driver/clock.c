@@ -25,6 +25,18 @@ void init_clock() {
 
 void reset_clock(u64 countdown_ms) {
     asm volatile("msr cntp_tval_el0, %[x]" ::[x] "r"(countdown_ms * ctx.one_ms));
+    asm volatile("msr cntp_ctl_el0, %[x]" ::[x] "r"(1ll));
+}
+
+// fire once the system counter reaches `timestamp`, which may be in the past.
+void set_clock_deadline(u64 timestamp) {
+    asm volatile("msr cntp_cval_el0, %[x]" ::[x] "r"(timestamp));
+    asm volatile("msr cntp_ctl_el0, %[x]" ::[x] "r"(1ll));
+}
+
+// disable the timer until the next `reset_clock` or `set_clock_deadline`, e.g. on an idle core.
+void stop_clock() {
+    asm volatile("msr cntp_ctl_el0, %[x]" ::[x] "r"(0ll));
 }
 
 void set_clock_handler(ClockHandler handler) {
@@ -6,5 +6,7 @@ typedef void (*ClockHandler)(void);
 
 void init_clock();
 void reset_clock(u64 countdown_ms);
+void set_clock_deadline(u64 timestamp);
+void stop_clock();
 void set_clock_handler(ClockHandler handler);
 void invoke_clock_handler();
@@ -24,8 +24,13 @@
 #define IRQ_SRC_TIMER     (1 << 11)  // global timer
 #define IRQ_SRC_GPU       (1 << 8)
 #define IRQ_SRC_CNTPNSIRQ (1 << 1)  // CPU clock
+#define IRQ_SRC_MBOX0     (1 << 4)  // core mailbox 0
 #define FIQ_SRC_CORE(i)   (LOCAL_BASE + 0x70 + 4 * (i))
 
+#define MBOX_CTRL_CORE(i) (LOCAL_BASE + 0x50 + 4 * (i))
+#define MBOX0_SET_CORE(i) (LOCAL_BASE + 0x80 + 0x10 * (i))
+#define MBOX0_CLR_CORE(i) (LOCAL_BASE + 0xC0 + 0x10 * (i))
+
 typedef struct {
     InterruptHandler handler[NUM_IRQ_TYPES];
 } InterruptContext;
@@ -55,6 +60,13 @@ void interrupt_global_handler() {
         invoke_clock_handler();
     }
 
+    // an IPI only has to make the core trap, which checks `need_resched`.
+    if (source & IRQ_SRC_MBOX0) {
+        source ^= IRQ_SRC_MBOX0;
+
+        device_put_u32(MBOX0_CLR_CORE(cpuid()), 0xffffffff);
+    }
+
     if (source & IRQ_SRC_GPU) {
         source ^= IRQ_SRC_GPU;
 
@@ -72,3 +84,13 @@ void interrupt_global_handler() {
     if (source != 0)
         PANIC("unknown interrupt sources: %x", source);
 }
+
+// let mailbox 0 of this core raise IRQs.
+void init_ipi() {
+    device_put_u32(MBOX_CTRL_CORE(cpuid()), 1);
+}
+
+// interrupt `cpu` through its mailbox 0.
+void send_ipi(usize cpu) {
+    device_put_u32(MBOX0_SET_CORE(cpu), 1);
+}
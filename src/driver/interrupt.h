@@ -16,3 +16,6 @@ typedef void (*InterruptHandler)(void);
 void init_interrupt();
 void set_interrupt_handler(InterruptType type, InterruptHandler handler);
 void interrupt_global_handler();
+
+void init_ipi();
+void send_ipi(usize cpu);
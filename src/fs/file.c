@@ -4,71 +4,165 @@
 #include "fs.h"
 #include <common/defines.h>
 #include <common/spinlock.h>
+#include <common/string.h>
+#include <core/arena.h>
 #include <core/console.h>
+#include <core/physical_memory.h>
 #include <core/sleeplock.h>
 #include <fs/inode.h>
 
 // struct devsw devsw[NDEV];
-struct {
-    struct SpinLock lock;
-    struct file file[NFILE];
-} ftable;
+static Arena arena;
 
-/* Optional since BSS is zero-initialized. */
 void fileinit() {
-    init_spinlock(&ftable.lock, "file table");
+    ArenaPageAllocator allocator = {.allocate = kalloc, .free = kfree};
+    init_arena(&arena, sizeof(struct file), allocator);
 }
 
 /* Allocate a file structure. */
 struct file *filealloc() {
-    struct file *f;
-
-    acquire_spinlock(&ftable.lock);
-    for (f = ftable.file; f < ftable.file + NFILE; f++) {
-        if (f->ref == 0) {
-            f->ref = 1;
-            release_spinlock(&ftable.lock);
-            return f;
-        }
-    }
-    release_spinlock(&ftable.lock);
-    return 0;
+    struct file *f = alloc_object(&arena);
+    if (f == 0)
+        return 0;
+    memset(f, 0, sizeof(*f));
+    f->type = FD_NONE;
+    init_rc(&f->rc);
+    increment_rc(&f->rc);
+    return f;
 }
 
 /* Increment ref count for file f. */
 struct file *filedup(struct file *f) {
-    acquire_spinlock(&ftable.lock);
-    if (f->ref < 1)
+    if (f->rc.count < 1)
         PANIC("filedup");
-    f->ref++;
-    release_spinlock(&ftable.lock);
+    increment_rc(&f->rc);
     return f;
 }
 
 /* Close file f. (Decrement ref count, close when reaches 0.) */
 void fileclose(struct file *f) {
-    struct file ff;
-
-    acquire_spinlock(&ftable.lock);
-    if (f->ref < 1)
+    if (f->rc.count < 1)
         PANIC("fileclose");
-    if (--f->ref > 0) {
-        release_spinlock(&ftable.lock);
+    if (!decrement_rc(&f->rc))
         return;
-    }
-    ff = *f;
-    f->ref = 0;
-    f->type = FD_NONE;
-    release_spinlock(&ftable.lock);
 
-    if (ff.type == FD_PIPE)
-        ;  // pipeclose(ff.pipe, ff.writable);
-    else if (ff.type == FD_INODE) {
+    if (f->type == FD_PIPE)
+        ;  // pipeclose(f->pipe, f->writable);
+    else if (f->type == FD_INODE) {
         OpContext ctx;
         bcache.begin_op(&ctx);
-        inodes.put(&ctx, ff.ip);
+        inodes.put(&ctx, f->ip);
         bcache.end_op(&ctx);
     }
+    free_object(f);
+}
+
+/* Initialize an empty descriptor table. */
+void init_fdtable(FdTable *t) {
+    memset(t, 0, sizeof(*t));
+    init_spinlock(&t->lock, "fdtable");
+}
+
+/*
+ * Install f at the lowest free descriptor of t. Returns the
+ * descriptor, or -1 if the table is full or out of memory.
+ */
+int fdtable_alloc(FdTable *t, struct file *f) {
+    acquire_spinlock(&t->lock);
+    if (t->full == ~(u64)0) {
+        release_spinlock(&t->lock);
+        return -1;
+    }
+
+    usize cell = (usize)__builtin_ctzll(~t->full);
+    usize fd = cell * BITMAP_BITS_PER_CELL + (usize)__builtin_ctzll(~t->open[cell]);
+    struct file ***page = &t->pages[fd / NOFILE_PAGE];
+    if (*page == 0) {
+        if ((*page = kalloc()) == 0) {
+            release_spinlock(&t->lock);
+            return -1;
+        }
+        memset(*page, 0, PAGE_SIZE);
+    }
+
+    (*page)[fd % NOFILE_PAGE] = f;
+    bitmap_set(t->open, fd);
+    if (t->open[cell] == ~(BitmapCell)0)
+        t->full |= BIT(cell);
+    release_spinlock(&t->lock);
+    return (int)fd;
+}
+
+static struct file *_fdtable_get(FdTable *t, int fd) {
+    if (fd < 0 || fd >= NOFILE || !bitmap_get(t->open, (usize)fd))
+        return 0;
+    return t->pages[(usize)fd / NOFILE_PAGE][(usize)fd % NOFILE_PAGE];
+}
+
+/*
+ * Return the file at descriptor fd of t with a reference taken, or NULL
+ * if fd is not open. The caller closes it when done, so that another
+ * thread closing fd cannot free it meanwhile.
+ */
+struct file *fdtable_get(FdTable *t, int fd) {
+    acquire_spinlock(&t->lock);
+    struct file *f = _fdtable_get(t, fd);
+    if (f)
+        filedup(f);
+    release_spinlock(&t->lock);
+    return f;
+}
+
+/* Free descriptor fd of t and return its file without closing it. */
+struct file *fdtable_remove(FdTable *t, int fd) {
+    acquire_spinlock(&t->lock);
+    struct file *f = _fdtable_get(t, fd);
+    if (f) {
+        t->pages[(usize)fd / NOFILE_PAGE][(usize)fd % NOFILE_PAGE] = 0;
+        bitmap_clear(t->open, (usize)fd);
+        t->full &= ~BIT((usize)fd / BITMAP_BITS_PER_CELL);
+    }
+    release_spinlock(&t->lock);
+    return f;
+}
+
+/*
+ * Fill the empty table dest with the descriptors of src, sharing
+ * their files. Returns -1 if out of memory, leaving dest to be
+ * released by fdtable_close_all.
+ */
+int fdtable_copy(FdTable *dest, FdTable *src) {
+    acquire_spinlock(&src->lock);
+    for (usize i = 0; i < NOFILE / NOFILE_PAGE; i++) {
+        if (src->pages[i] == 0)
+            continue;
+        if ((dest->pages[i] = kalloc()) == 0) {
+            release_spinlock(&src->lock);
+            return -1;
+        }
+        for (usize j = 0; j < NOFILE_PAGE; j++) {
+            struct file *f = src->pages[i][j];
+            dest->pages[i][j] = f ? filedup(f) : 0;
+        }
+    }
+    memmove(dest->open, src->open, sizeof(dest->open));
+    dest->full = src->full;
+    release_spinlock(&src->lock);
+    return 0;
+}
+
+/* Close all files in t and free its pages. */
+void fdtable_close_all(FdTable *t) {
+    for (usize i = 0; i < NOFILE / NOFILE_PAGE; i++) {
+        if (t->pages[i] == 0)
+            continue;
+        for (usize j = 0; j < NOFILE_PAGE; j++) {
+            if (t->pages[i][j])
+                fileclose(t->pages[i][j]);
+        }
+        kfree(t->pages[i]);
+    }
+    init_fdtable(t);
 }
 
 /* Get metadata about file f. */
@@ -84,8 +178,28 @@ int filestat(struct file *f, struct stat *st) {
 
 /* Read from file f. */
 isize fileread(struct file *f, char *addr, isize n) {
-    isize r;
+    struct iovec iov = {.iov_base = addr, .iov_len = (usize)n};
+    return filereadv(f, &iov, 1, NULL);
+}
 
+/* Write to file f. */
+isize filewrite(struct file *f, char *addr, isize n) {
+    struct iovec iov = {.iov_base = addr, .iov_len = (usize)n};
+    return filewritev(f, &iov, 1, NULL);
+}
+
+// the number of bytes beginning at `offset` that one atomic operation can write
+// into an inode without overflowing its log reservation.
+static INLINE usize _op_bytes(usize offset, usize n) {
+    return MIN(n, round_down(offset, BLOCK_SIZE) + inodes.max_op_blocks * BLOCK_SIZE - offset);
+}
+
+/*
+ * Read from file f into iovcnt segments of iov, holding the inode
+ * lock only once. If off is not NULL, read at *off and update it
+ * instead of the file offset.
+ */
+isize filereadv(struct file *f, struct iovec *iov, int iovcnt, usize *off) {
     if (f->readable == 0)
         return -1;
 
@@ -94,57 +208,250 @@ isize fileread(struct file *f, char *addr, isize n) {
     }
 
     if (f->type == FD_INODE) {
-        inodes.lock(f->ip);
-        r = (isize)inodes.read(f->ip, (u8 *)addr, f->off, (usize)n);
-        f->off += (u64)r;
-        inodes.unlock(f->ip);
-        return r;
+        Inode *ip = f->ip;
+        inodes.lock(ip);
+
+        usize pos = off ? *off : f->off, tot = 0;
+        for (struct iovec *p = iov; p < iov + iovcnt; p++) {
+            if (ip->entry.type != INODE_DEVICE && pos >= ip->entry.num_bytes)
+                break;
+
+            usize r = inodes.read(ip, (u8 *)p->iov_base, pos, p->iov_len);
+            pos += r;
+            tot += r;
+            if (r < p->iov_len)
+                break;
+        }
+
+        if (off)
+            *off = pos;
+        else
+            f->off = pos;
+        inodes.unlock(ip);
+        return (isize)tot;
     }
     PANIC("fileread");
     return -1;
 }
 
-/* Write to file f. */
-isize filewrite(struct file *f, char *addr, isize n) {
-    isize r;
-
+/*
+ * Write iovcnt segments of iov to file f. If off is not NULL, write
+ * at *off and update it instead of the file offset.
+ */
+isize filewritev(struct file *f, struct iovec *iov, int iovcnt, usize *off) {
     if (f->writable == 0)
         return -1;
     // if (f->type == FD_PIPE)
     //     return pipewrite(f->pipe, addr, n);
     if (f->type == FD_INODE) {
+        Inode *ip = f->ip;
+        usize n = 0;
+        for (struct iovec *p = iov; p < iov + iovcnt; p++) {
+            n += p->iov_len;
+        }
+
         /*
-         * Write a few blocks at a time to avoid exceeding
-         * the maximum log transaction size, including
-         * i-node, indirect block, allocation blocks,
-         * and 2 blocks of slop for non-aligned writes.
-         * This really belongs lower down, since writei()
-         * might be writing a device like the console.
+         * Pack as many segments as the log reservation of one
+         * atomic operation allows, so that a vector usually takes
+         * a single operation and a single inode lock.
          */
-        isize max = ((INODE_MAX_BLOCKS - 1 - 1 - 2) / 2) * 512;
-        isize i = 0;
-        while (i < n) {
-            isize n1 = n - i;
-            if (n1 > max)
-                n1 = max;
-
+        usize i = 0, seg_off = 0;
+        struct iovec *seg = iov;
+        bool failed = false;
+        while (!failed && i < n) {
             OpContext ctx;
             bcache.begin_op(&ctx);
-            inodes.lock(f->ip);
+            inodes.lock(ip);
 
-            r = (isize)inodes.write(&ctx, f->ip, (u8 *)(addr + i), f->off, (usize)n1);
-            f->off += (u64)r;
-            inodes.unlock(f->ip);
-            bcache.end_op(&ctx);
+            usize pos = off ? *off : f->off;
+            usize budget = _op_bytes(pos, n - i);
+            if (ip->entry.type != INODE_DEVICE) {
+                if (pos > ip->entry.num_bytes || pos >= INODE_MAX_BYTES)
+                    failed = true;
+                else
+                    budget = MIN(budget, INODE_MAX_BYTES - pos);
+            }
 
-            if (r < 0)
-                break;
-            if (r != n1)
-                PANIC("short filewrite");
-            i += r;
+            while (!failed && budget > 0) {
+                usize n1 = MIN(budget, seg->iov_len - seg_off);
+                usize r = inodes.write(&ctx, ip, (u8 *)seg->iov_base + seg_off, pos, n1);
+                if (r != n1)
+                    PANIC("short filewrite");
+
+                pos += r;
+                budget -= r;
+                i += r;
+                seg_off += r;
+                if (seg_off == seg->iov_len) {
+                    seg++;
+                    seg_off = 0;
+                }
+            }
+
+            if (off)
+                *off = pos;
+            else
+                f->off = pos;
+            inodes.unlock(ip);
+            bcache.end_op(&ctx);
         }
-        return i == n ? n : -1;
+        return failed && i == 0 ? -1 : (isize)i;
     }
     PANIC("filewrite");
     return -1;
 }
+
+// lock two inodes in the order of inode numbers.
+static void _lock_pair(Inode *a, Inode *b) {
+    if (a == b) {
+        inodes.lock(a);
+        return;
+    }
+    if (a->inode_no > b->inode_no) {
+        Inode *t = a;
+        a = b;
+        b = t;
+    }
+    inodes.lock(a);
+    inodes.lock(b);
+}
+
+static void _unlock_pair(Inode *a, Inode *b) {
+    inodes.unlock(a);
+    if (a != b)
+        inodes.unlock(b);
+}
+
+/*
+ * Copy at most n bytes from in to out inside the kernel. Both must
+ * be regular files. If in_off (or out_off) is not NULL, it is used
+ * and updated instead of the file offset of in (or out).
+ */
+isize filecopy(struct file *in, usize *in_off, struct file *out, usize *out_off, usize n) {
+    if (in->readable == 0 || out->writable == 0)
+        return -1;
+    if (in->type != FD_INODE || out->type != FD_INODE)
+        return -1;
+
+    Inode *src = in->ip, *dest = out->ip;
+    usize src_off = in_off ? *in_off : in->off;
+    usize dest_off = out_off ? *out_off : out->off;
+
+    usize i = 0;
+    bool failed = false;
+    while (i < n) {
+        usize n1 = _op_bytes(dest_off, n - i);
+
+        OpContext ctx;
+        bcache.begin_op(&ctx);
+        _lock_pair(src, dest);
+
+        if (dest->entry.type != INODE_REGULAR || dest_off > dest->entry.num_bytes)
+            failed = true;
+        else
+            n1 = MIN(n1, INODE_MAX_BYTES - dest_off);
+        if (src->entry.type != INODE_REGULAR || src_off > src->entry.num_bytes || n1 == 0)
+            failed = true;
+        if (src == dest && src_off < dest_off + n1 && dest_off < src_off + n1)
+            failed = true;
+
+        usize r = failed ? 0 : inodes.copy(&ctx, dest, dest_off, src, src_off, n1);
+
+        _unlock_pair(src, dest);
+        bcache.end_op(&ctx);
+
+        src_off += r;
+        dest_off += r;
+        i += r;
+        if (failed || r < n1)
+            break;
+    }
+
+    if (in_off)
+        *in_off = src_off;
+    else
+        in->off = src_off;
+    if (out_off)
+        *out_off = dest_off;
+    else
+        out->off = dest_off;
+    return failed && i == 0 ? -1 : (isize)i;
+}
+
+/*
+ * Copy at most n bytes from in to the file offset of out. Only a
+ * regular file is copied to in place. Anything else is read into a
+ * bounce page and written with filewrite, so that a device is never
+ * written while the lock of in or a log operation is held.
+ */
+isize filesend(struct file *in, usize *in_off, struct file *out, usize n) {
+    // the entry may not be loaded until the inode is locked.
+    bool regular = false;
+    if (out->type == FD_INODE) {
+        inodes.lock(out->ip);
+        regular = out->ip->entry.type == INODE_REGULAR;
+        inodes.unlock(out->ip);
+    }
+    if (regular)
+        return filecopy(in, in_off, out, NULL, n);
+    if (in->readable == 0 || out->writable == 0 || in->type != FD_INODE)
+        return -1;
+
+    char *buf = kalloc();
+    if (buf == NULL)
+        return -1;
+
+    usize i = 0;
+    bool failed = false;
+    while (i < n) {
+        struct iovec iov = {.iov_base = buf, .iov_len = MIN(n - i, (usize)PAGE_SIZE)};
+        isize r = filereadv(in, &iov, 1, in_off);
+        if (r <= 0) {
+            failed = r < 0;
+            break;
+        }
+        isize w = filewrite(out, buf, r);
+        if (w < r) {
+            // give back what was read but not written.
+            usize back = (usize)(r - MAX(w, 0));
+            if (in_off)
+                *in_off -= back;
+            else
+                in->off -= back;
+            failed = w < 0;
+            i += (usize)MAX(w, 0);
+            break;
+        }
+        i += (usize)w;
+    }
+
+    kfree(buf);
+    return failed && i == 0 ? -1 : (isize)i;
+}
+
+/*
+ * Write a dirty page of a shared mapping back to ip at offset.
+ * A mapping never extends the file, so the part of the page past
+ * the end of the file is dropped.
+ */
+void filepageout(Inode *ip, void *page, usize offset) {
+    usize i = 0;
+    while (i < PAGE_SIZE) {
+        OpContext ctx;
+        bcache.begin_op(&ctx);
+        inodes.lock(ip);
+
+        usize r = 0, pos = offset + i;
+        if (pos < ip->entry.num_bytes) {
+            usize n = _op_bytes(pos, MIN(PAGE_SIZE - i, ip->entry.num_bytes - pos));
+            r = inodes.write(&ctx, ip, (u8 *)page + i, pos, n);
+        }
+
+        inodes.unlock(ip);
+        bcache.end_op(&ctx);
+
+        if (r == 0)
+            break;
+        i += r;
+    }
+}
@@ -1,17 +1,25 @@
 #pragma once
 
+#include <common/bitmap.h>
 #include <common/defines.h>
+#include <common/rc.h>
 #include <core/sleeplock.h>
 #include <fs/defines.h>
 #include <fs/fs.h>
 #include <fs/inode.h>
 #include <sys/stat.h>
 
-#define NFILE 100  // Open files per system
+#define NOFILE      4096  // maximum open files per process
+#define NOFILE_PAGE (PAGE_SIZE / sizeof(struct file *))
+
+struct iovec {
+    void *iov_base; /* Starting address. */
+    usize iov_len;  /* Number of bytes to transfer. */
+};
 
 typedef struct file {
     enum { FD_NONE, FD_PIPE, FD_INODE } type;
-    int ref;
+    RefCount rc;
     char readable;
     char writable;
     struct pipe *pipe;
@@ -19,6 +27,18 @@ typedef struct file {
     usize off;
 } File;
 
+// descriptor table of a process. Slots live in pages allocated on demand.
+// `open` marks used descriptors, and bit i of `full` is set if cell i of
+// `open` is full, so the lowest free descriptor takes two bit scans.
+// `full` has 64 bits, so NOFILE must not exceed 64 * 64. the threads of a
+// process share its table, so `lock` guards the slots.
+typedef struct {
+    SpinLock lock;
+    struct file **pages[NOFILE / NOFILE_PAGE];
+    Bitmap(open, NOFILE);
+    u64 full;
+} FdTable;
+
 void fileinit();
 struct file *filealloc();
 struct file *filedup(struct file *f);
@@ -26,11 +46,29 @@ void fileclose(struct file *f);
 int filestat(struct file *f, struct stat *st);
 isize fileread(struct file *f, char *addr, isize n);
 isize filewrite(struct file *f, char *addr, isize n);
+isize filereadv(struct file *f, struct iovec *iov, int iovcnt, usize *off);
+isize filewritev(struct file *f, struct iovec *iov, int iovcnt, usize *off);
+void init_fdtable(FdTable *t);
+int fdtable_alloc(FdTable *t, struct file *f);
+struct file *fdtable_get(FdTable *t, int fd);
+struct file *fdtable_remove(FdTable *t, int fd);
+int fdtable_copy(FdTable *dest, FdTable *src);
+void fdtable_close_all(FdTable *t);
+isize filecopy(struct file *in, usize *in_off, struct file *out, usize *out_off, usize n);
+isize filesend(struct file *in, usize *in_off, struct file *out, usize n);
+void filepageout(Inode *ip, void *page, usize offset);
 
 int sys_dup();
 isize sys_read();
 isize sys_write();
+isize sys_readv();
 isize sys_writev();
+isize sys_pread64();
+isize sys_pwrite64();
+isize sys_preadv();
+isize sys_pwritev();
+isize sys_copy_file_range();
+isize sys_sendfile();
 int sys_close();
 int sys_fstat();
 int sys_fstatat();
@@ -45,6 +45,13 @@ void init_inodes(const SuperBlock *_sblock, const BlockCache *_cache) {
     cache = _cache;
     init_arena(&arena, sizeof(Inode), allocator);
 
+    // n data blocks and the indirect block may each dirty a bitmap block of its own.
+    usize num_bitmap_blocks = (sblock->num_blocks + BIT_PER_BLOCK - 1) / BIT_PER_BLOCK;
+    usize n = OP_MAX_NUM_BLOCKS - 3;
+    while (n > 1 && n + 2 + MIN(n + 1, num_bitmap_blocks) > OP_MAX_NUM_BLOCKS)
+        n--;
+    inodes.max_op_blocks = n;
+
     if (ROOT_INODE_NO < sblock->num_inodes)
         inodes.root = inodes.get(ROOT_INODE_NO);
     else
@@ -58,6 +65,24 @@ static void init_inode(Inode *inode) {
     init_list_node(&inode->node);
     inode->inode_no = 0;
     inode->valid = false;
+    memset(inode->pages, 0, sizeof(inode->pages));
+    memset(inode->mapped, 0, sizeof(inode->mapped));
+}
+
+// drop all cached pages of `inode`, e.g. when its content is discarded.
+// pinned pages can not go away, so they are zeroed and stay cached, which
+// matches the content of an empty file.
+static void drop_pages(Inode *inode) {
+    for (usize i = 0; i < INODE_MAX_PAGES; i++) {
+        if (inode->pages[i] == NULL)
+            continue;
+        if (inode->mapped[i] > 0) {
+            memset(inode->pages[i], 0, PAGE_SIZE);
+        } else {
+            kfree(inode->pages[i]);
+            inode->pages[i] = NULL;
+        }
+    }
 }
 
 // see `inode.h`.
@@ -174,6 +199,7 @@ static void inode_clear(OpContext *ctx, Inode *inode) {
 
     entry->num_bytes = 0;
     inode_sync(ctx, inode, true);
+    drop_pages(inode);
 }
 
 // see `inode.h`.
@@ -203,6 +229,7 @@ static void inode_put(OpContext *ctx, Inode *inode) {
 
     if (decrement_rc(&inode->rc)) {
         detach_from_list(&inode->node);
+        drop_pages(inode);
         free_object(inode);
     }
     release_spinlock(&lock);
@@ -252,6 +279,80 @@ static usize inode_map(OpContext *ctx, Inode *inode, usize offset, bool *modifie
     return addr;
 }
 
+// read `count` bytes of `inode` at `offset` from its blocks, bypassing the
+// page cache.
+//
+// NOTE: caller must hold the lock of `inode`.
+static void read_blocks(Inode *inode, u8 *dest, usize offset, usize count) {
+    usize step = 0, end = offset + count;
+    for (usize begin = offset; begin < end; begin += step, dest += step) {
+        bool modified = false;
+        usize block_no = inode_map(NULL, inode, begin, &modified);
+        assert(!modified);
+
+        Block *block = cache->acquire(block_no);
+        usize index = begin % BLOCK_SIZE;
+        step = MIN(end - begin, BLOCK_SIZE - index);
+        memmove(dest, block->data + index, step);
+        cache->release(block);
+    }
+}
+
+// read page `index` of `inode` into a new cached page, charged to the container
+// of the reader. NULL is returned if out of memory.
+//
+// NOTE: caller must hold the lock of `inode`.
+static u8 *fill_page(Inode *inode, usize index) {
+    u8 *page = kalloc_charged();
+    if (page == NULL)
+        return NULL;
+
+    usize offset = index * PAGE_SIZE, n = 0;
+    if (offset < inode->entry.num_bytes) {
+        n = MIN((usize)PAGE_SIZE, inode->entry.num_bytes - offset);
+        read_blocks(inode, page, offset, n);
+    }
+    memset(page + n, 0, PAGE_SIZE - n);
+
+    inode->pages[index] = page;
+    return page;
+}
+
+// return cached page `index` of `inode`. On a miss, the page is read in along
+// with the following `PAGE_CACHE_READAHEAD` pages inside the file.
+//
+// NOTE: caller must hold the lock of `inode`.
+static u8 *load_page(Inode *inode, usize index) {
+    assert(index < INODE_MAX_PAGES);
+    if (inode->pages[index] != NULL)
+        return inode->pages[index];
+
+    u8 *page = fill_page(inode, index);
+    usize last = MIN(index + PAGE_CACHE_READAHEAD, INODE_MAX_PAGES - 1);
+    for (usize i = index + 1; page != NULL && i <= last; i++) {
+        if (i * PAGE_SIZE >= inode->entry.num_bytes)
+            break;
+        if (inode->pages[i] == NULL && fill_page(inode, i) == NULL)
+            break;
+    }
+    return page;
+}
+
+// copy `count` bytes from `src` to the pages of `inode` at `offset` that are
+// cached. Pages not cached are left for `load_page`.
+//
+// NOTE: caller must hold the lock of `inode`.
+static void update_pages(Inode *inode, const u8 *src, usize offset, usize count) {
+    usize step = 0, end = offset + count;
+    for (usize begin = offset; begin < end; begin += step, src += step) {
+        usize index = begin % PAGE_SIZE;
+        step = MIN(end - begin, PAGE_SIZE - index);
+        u8 *page = inode->pages[begin / PAGE_SIZE];
+        if (page != NULL)
+            memmove(page + index, src, step);
+    }
+}
+
 // see `inode.h`.
 static usize inode_read(Inode *inode, u8 *dest, usize offset, usize count) {
     InodeEntry *entry = &inode->entry;
@@ -268,17 +369,20 @@ static usize inode_read(Inode *inode, u8 *dest, usize offset, usize count) {
     assert(end <= entry->num_bytes);
     assert(offset <= end);
 
+    if (entry->type != INODE_REGULAR) {
+        read_blocks(inode, dest, offset, count);
+        return count;
+    }
+
     usize step = 0;
     for (usize begin = offset; begin < end; begin += step, dest += step) {
-        bool modified = false;
-        usize block_no = inode_map(NULL, inode, begin, &modified);
-        assert(!modified);
-
-        Block *block = cache->acquire(block_no);
-        usize index = begin % BLOCK_SIZE;
-        step = MIN(end - begin, BLOCK_SIZE - index);
-        memmove(dest, block->data + index, step);
-        cache->release(block);
+        usize index = begin % PAGE_SIZE;
+        step = MIN(end - begin, PAGE_SIZE - index);
+        u8 *page = load_page(inode, begin / PAGE_SIZE);
+        if (page != NULL)
+            memmove(dest, page + index, step);
+        else
+            read_blocks(inode, dest, begin, step);
     }
     return count;
 }
@@ -306,9 +410,10 @@ static usize inode_write(OpContext *ctx, Inode *inode, u8 *src, usize offset, us
         cache->sync(ctx, block);
         cache->release(block);
     }
+    update_pages(inode, src - count, offset, count);
 
     if (end > entry->num_bytes) {
-        entry->num_bytes = (u16)end;
+        entry->num_bytes = (u32)end;
         modified = true;
     }
     if (modified)
@@ -316,6 +421,95 @@ static usize inode_write(OpContext *ctx, Inode *inode, u8 *src, usize offset, us
     return count;
 }
 
+// see `inode.h`.
+static usize inode_copy(OpContext *ctx,
+                        Inode *dest,
+                        usize dest_offset,
+                        Inode *src,
+                        usize src_offset,
+                        usize count) {
+    InodeEntry *entry = &dest->entry;
+    assert(entry->type == INODE_REGULAR);
+    assert(src->entry.type == INODE_REGULAR);
+    assert(src_offset <= src->entry.num_bytes);
+    count = MIN(count, src->entry.num_bytes - src_offset);
+
+    usize step = 0;
+    usize end = dest_offset + count;
+    assert(dest_offset <= entry->num_bytes);
+    assert(end <= INODE_MAX_BYTES);
+    assert(dest != src || end <= src_offset || src_offset + count <= dest_offset);
+
+    // allocate destination blocks in one pass.
+    bool modified = false;
+    for (usize begin = round_down(dest_offset, BLOCK_SIZE); begin < end; begin += BLOCK_SIZE) {
+        inode_map(ctx, dest, begin, &modified);
+    }
+
+    for (usize begin = dest_offset, from = src_offset; begin < end; begin += step, from += step) {
+        usize src_no = inode_map(NULL, src, from, NULL);
+        usize dest_no = inode_map(NULL, dest, begin, NULL);
+        usize src_index = from % BLOCK_SIZE, dest_index = begin % BLOCK_SIZE;
+        step = MIN(end - begin, BLOCK_SIZE - MAX(src_index, dest_index));
+
+        // non-overlapping ranges in the same inode may still share one block.
+        Block *in = cache->acquire(src_no);
+        Block *out = dest_no == src_no ? in : cache->acquire(dest_no);
+        memmove(out->data + dest_index, in->data + src_index, step);
+        update_pages(dest, in->data + src_index, begin, step);
+        cache->sync(ctx, out);
+        if (out != in)
+            cache->release(out);
+        cache->release(in);
+    }
+
+    if (end > entry->num_bytes) {
+        entry->num_bytes = (u32)end;
+        modified = true;
+    }
+    if (modified)
+        inode_sync(ctx, dest, true);
+    return count;
+}
+
+// see `inode.h`.
+static u8 *inode_get_page(Inode *inode, usize index) {
+    assert(inode->entry.type == INODE_REGULAR);
+    u8 *page = load_page(inode, index);
+    if (page != NULL)
+        inode->mapped[index]++;
+    return page;
+}
+
+// see `inode.h`.
+static void inode_put_page(Inode *inode, usize index) {
+    assert(index < INODE_MAX_PAGES);
+    assert(inode->pages[index] != NULL && inode->mapped[index] > 0);
+    inode->mapped[index]--;
+}
+
+// see `inode.h`.
+static usize inode_shrink(bool (*match)(void *page, void *arg), void *arg, usize count) {
+    usize n = 0;
+    if (sblock == NULL || !try_acquire_spinlock(&lock))
+        return 0;
+    for (ListNode *node = head.next; node != &head && n < count; node = node->next) {
+        Inode *inode = container_of(node, Inode, node);
+        if (!try_acquire_spinlock(&inode->lock))
+            continue;
+        for (usize i = 0; i < INODE_MAX_PAGES && n < count; i++) {
+            if (inode->pages[i] != NULL && inode->mapped[i] == 0 && match(inode->pages[i], arg)) {
+                kfree(inode->pages[i]);
+                inode->pages[i] = NULL;
+                n++;
+            }
+        }
+        release_spinlock(&inode->lock);
+    }
+    release_spinlock(&lock);
+    return n;
+}
+
 // see `inode.h`.
 static usize inode_lookup(Inode *inode, const char *name, usize *index) {
     InodeEntry *entry = &inode->entry;
@@ -417,7 +611,7 @@ static Inode *namex(const char *path, int nameiparent, char *name, OpContext *ct
     if (*path == '/')
         ip = inodes.get(1);
     else
-        ip = inodes.share(thiscpu()->proc->cwd);
+        ip = inodes.share(thiscpu()->proc->group_leader->cwd);
 
     while ((path = skipelem(path, name)) != 0) {
         inodes.lock(ip);
@@ -494,6 +688,10 @@ InodeTree inodes = {
     .put = inode_put,
     .read = inode_read,
     .write = inode_write,
+    .copy = inode_copy,
+    .get_page = inode_get_page,
+    .put_page = inode_put_page,
+    .shrink = inode_shrink,
     .lookup = inode_lookup,
     .insert = inode_insert,
     .remove = inode_remove,
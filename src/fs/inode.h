@@ -1,5 +1,6 @@
 #pragma once
 
+#include <aarch64/mmu.h>
 #include <common/list.h>
 #include <common/rc.h>
 #include <common/spinlock.h>
@@ -9,6 +10,12 @@
 
 #define ROOT_INODE_NO 1
 
+// the number of pages that the largest file spans.
+#define INODE_MAX_PAGES ((INODE_MAX_BYTES + PAGE_SIZE - 1) / PAGE_SIZE)
+
+// the number of pages read ahead after a page cache miss.
+#define PAGE_CACHE_READAHEAD 2
+
 struct InodeTree;
 
 typedef struct {
@@ -23,11 +30,24 @@ typedef struct {
 
     bool valid;        // is `entry` loaded?
     InodeEntry entry;  // real inode data on the disk.
+
+    // page cache of a regular file, indexed by page number. A file spans at
+    // most `INODE_MAX_PAGES` pages, so a radix tree of a single level is
+    // enough. NULL slots are not cached. Bytes past the end of the file read
+    // as zero. `mapped` counts the page table entries pinning each page.
+    u8 *pages[INODE_MAX_PAGES];
+    u16 mapped[INODE_MAX_PAGES];
 } Inode;
 
 typedef struct InodeTree {
     Inode *root;
 
+    // the maximum number of data blocks that one atomic operation can write into a
+    // single inode, set by `init_inodes`. The remaining log entries of the operation
+    // are reserved for the inode block, the indirect block and the allocation bitmap
+    // blocks, one for each block allocated, up to the number of bitmap blocks.
+    usize max_op_blocks;
+
     // allocate a new zero-initialized inode on disk.
     // return a non-zero inode number if allocation succeeds. Otherwise `alloc` panics.
     usize (*alloc)(OpContext *ctx, InodeType type);
@@ -73,15 +93,57 @@ typedef struct InodeTree {
     void (*put)(OpContext *ctx, Inode *inode);
 
     // read exactly `count` bytes from `inode`, beginning at `offset`, to `dest`.
+    // regular files are read through the page cache, which reads ahead
+    // `PAGE_CACHE_READAHEAD` pages on a miss.
     //
     // NOTE: caller must hold the lock of `inode`.
     usize (*read)(Inode *inode, u8 *dest, usize offset, usize count);
 
     // write exactly `count` bytes from `src` to `inode`, beginning at `offset`.
+    // data goes to the log through the block cache, and to cached pages as well.
     //
     // NOTE: caller must hold the lock of `inode`.
     usize (*write)(OpContext *ctx, Inode *inode, u8 *src, usize offset, usize count);
 
+    // copy at most `count` bytes from `src` at `src_offset` to `dest` at `dest_offset`.
+    // data moves between cached blocks directly, without a bounce buffer in between.
+    // all missing blocks of `dest` are allocated before copying, so that the inode
+    // entry and the indirect block are written only once. both inodes must be regular
+    // files; devices are written through `write` outside of the copy.
+    // the number of copied bytes is returned, which is less than `count` only if
+    // `src` ends early.
+    //
+    // NOTE: caller must hold the locks of both `src` and `dest`. Ranges in the same
+    // inode must not overlap.
+    usize (*copy)(OpContext *ctx,
+                  Inode *dest,
+                  usize dest_offset,
+                  Inode *src,
+                  usize src_offset,
+                  usize count);
+
+    // for regular file inode only.
+    //
+    // return the cached page `index` of `inode`, reading it in if needed, and pin
+    // it in the cache until `put_page`. The page may be mapped into user space;
+    // it is kept up to date by `write` and `copy`. NULL is returned if out of memory.
+    //
+    // NOTE: caller must hold the lock of `inode`.
+    u8 *(*get_page)(Inode *inode, usize index);
+
+    // for regular file inode only.
+    //
+    // unpin page `index` of `inode` pinned by `get_page`.
+    //
+    // NOTE: caller must hold the lock of `inode`.
+    void (*put_page)(Inode *inode, usize index);
+
+    // drop at most `count` cached pages that are not pinned and that `match`
+    // accepts, and return how many were dropped. cached pages are never dirty.
+    // inodes that are locked are skipped, so it never blocks and can be called
+    // with any lock held.
+    usize (*shrink)(bool (*match)(void *page, void *arg), void *arg, usize count);
+
     // for directory inode only.
     //
     // look up `name` in directory `inode`.
@@ -307,6 +307,159 @@ void test_large_file() {
     assert_eq(mock.count_blocks(), 0);
 }
 
+void test_copy() {
+    mock.begin_op(ctx);
+    usize ino[2] = {inodes.alloc(ctx, INODE_REGULAR), inodes.alloc(ctx, INODE_REGULAR)};
+    mock.end_op(ctx);
+
+    constexpr usize size = 20000;
+    u8 buf[size], copy[size];
+    std::mt19937 gen(0x87654321);
+    for (usize i = 0; i < size; i++) {
+        copy[i] = gen() & 0xff;
+    }
+
+    auto *p = inodes.get(ino[0]);
+    auto *q = inodes.get(ino[1]);
+    inodes.lock(p);
+    inodes.lock(q);
+
+    mock.begin_op(ctx);
+    inodes.write(ctx, p, copy, 0, size);
+    mock.end_op(ctx);
+
+    // unaligned source and destination offsets.
+    for (usize i = 0, n = 0; i < size; i += n) {
+        n = std::min(static_cast<usize>(gen() % 3000), size - i);
+
+        mock.begin_op(ctx);
+        assert_eq(inodes.copy(ctx, q, i, p, i + 7, n), std::min(n, size - i - 7));
+        mock.end_op(ctx);
+    }
+    assert_eq(mock.inspect(ino[1])->num_bytes, size - 7);
+
+    // copy stops at the end of source.
+    mock.begin_op(ctx);
+    assert_eq(inodes.copy(ctx, q, 0, p, size - 100, 1000), 100);
+    mock.end_op(ctx);
+
+    mock.fill_junk();
+    inodes.read(q, buf, 0, size - 7);
+    for (usize i = 0; i < 100; i++) {
+        assert_eq(buf[i], copy[size - 100 + i]);
+    }
+    for (usize i = 100; i < size - 7; i++) {
+        assert_eq(buf[i], copy[i + 7]);
+    }
+
+    // non-overlapping ranges inside one inode.
+    mock.begin_op(ctx);
+    assert_eq(inodes.copy(ctx, p, size, p, 3, 1000), 1000);
+    mock.end_op(ctx);
+    inodes.read(p, buf, size, 1000);
+    for (usize i = 0; i < 1000; i++) {
+        assert_eq(buf[i], copy[i + 3]);
+    }
+
+    inodes.unlock(q);
+    inodes.unlock(p);
+
+    mock.begin_op(ctx);
+    inodes.put(ctx, p);
+    inodes.put(ctx, q);
+    mock.end_op(ctx);
+
+    assert_eq(mock.count_inodes(), 1);
+    assert_eq(mock.count_blocks(), 0);
+}
+
+void test_page_cache() {
+    mock.begin_op(ctx);
+    usize ino[2] = {inodes.alloc(ctx, INODE_REGULAR), inodes.alloc(ctx, INODE_REGULAR)};
+    mock.end_op(ctx);
+
+    constexpr usize size = 5 * PAGE_SIZE + 100;
+    u8 buf[size], copy[size];
+    std::mt19937 gen(0x13579bdf);
+    for (usize i = 0; i < size; i++) {
+        copy[i] = gen() & 0xff;
+    }
+
+    auto *p = inodes.get(ino[0]);
+    auto *q = inodes.get(ino[1]);
+    inodes.lock(p);
+    inodes.lock(q);
+
+    for (usize i = 0, n = 0; i < size; i += n) {
+        n = std::min(inodes.max_op_blocks * BLOCK_SIZE, size - i);
+        mock.begin_op(ctx);
+        inodes.write(ctx, p, copy + i, i, n);
+        mock.end_op(ctx);
+    }
+
+    // writes do not populate the cache, and a miss reads ahead.
+    for (usize i = 0; i < INODE_MAX_PAGES; i++) {
+        assert_eq(p->pages[i], nullptr);
+    }
+    inodes.read(p, buf, 10, 1);
+    assert_eq(buf[0], copy[10]);
+    for (usize i = 0; i < INODE_MAX_PAGES; i++) {
+        assert_eq(p->pages[i] != nullptr, i <= PAGE_CACHE_READAHEAD);
+    }
+
+    inodes.read(p, buf, 0, size);
+    for (usize i = 0; i < size; i++) {
+        assert_eq(buf[i], copy[i]);
+    }
+
+    // a pinned page sees later writes and copies, and zeros past the end.
+    u8 *page = inodes.get_page(p, 5);
+    for (usize i = 100; i < PAGE_SIZE; i++) {
+        assert_eq(page[i], 0);
+    }
+    for (usize i = 0; i < 1000; i++) {
+        copy[PAGE_SIZE + i] = gen() & 0xff;
+    }
+    mock.begin_op(ctx);
+    inodes.write(ctx, p, copy + PAGE_SIZE, PAGE_SIZE, 1000);
+    inodes.copy(ctx, q, 0, p, PAGE_SIZE, 1000);
+    mock.end_op(ctx);
+    assert_eq(p->pages[1][999], copy[PAGE_SIZE + 999]);
+    inodes.read(q, buf, 0, 1000);
+    for (usize i = 0; i < 1000; i++) {
+        assert_eq(buf[i], copy[PAGE_SIZE + i]);
+    }
+
+    mock.begin_op(ctx);
+    inodes.write(ctx, p, copy, size, 50);
+    mock.end_op(ctx);
+    for (usize i = 0; i < 50; i++) {
+        assert_eq(page[100 + i], copy[i]);
+    }
+
+    // clear keeps the pinned page, zeroed.
+    mock.begin_op(ctx);
+    inodes.clear(ctx, p);
+    mock.end_op(ctx);
+    assert_eq(p->pages[0], nullptr);
+    assert_eq(p->pages[5], page);
+    for (usize i = 0; i < PAGE_SIZE; i++) {
+        assert_eq(page[i], 0);
+    }
+    inodes.put_page(p, 5);
+
+    inodes.unlock(q);
+    inodes.unlock(p);
+
+    mock.begin_op(ctx);
+    inodes.put(ctx, p);
+    inodes.put(ctx, q);
+    mock.end_op(ctx);
+
+    assert_eq(mock.count_inodes(), 1);
+    assert_eq(mock.count_blocks(), 0);
+}
+
 void test_dir() {
     usize ino[5] = {1};
 
@@ -411,6 +564,8 @@ int main() {
         {"share", adhoc::test_share},
         {"small_file", adhoc::test_small_file},
         {"large_file", adhoc::test_large_file},
+        {"copy", adhoc::test_copy},
+        {"page_cache", adhoc::test_page_cache},
         {"dir", adhoc::test_dir},
     };
     Runner(tests).run();
@@ -25,8 +25,14 @@ void *kalloc() {
     return q;
 }
 
+void *kalloc_charged() {
+    return kalloc();
+}
+
 void kfree(void *ptr) {
-    free(ref[reinterpret_cast<u8 *>(ptr)]);
+    u8 *q = reinterpret_cast<u8 *>(ptr);
+    free(ref[q]);
+    ref.erase(q);
 }
 
 void init_arena(Arena *arena, usize object_size, ArenaPageAllocator allocator [[maybe_unused]]) {
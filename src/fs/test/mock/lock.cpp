@@ -47,6 +47,14 @@ void release_spinlock(struct SpinLock *lock) {
     mtx_map[lock].unlock();
 }
 
+bool try_acquire_spinlock(struct SpinLock *lock) {
+    auto &m = mtx_map[lock];
+    if (!m.mutex.try_lock())
+        return false;
+    m.locked = true;
+    return true;
+}
+
 bool holding_spinlock(struct SpinLock *lock) {
     return mtx_map[lock].locked;
 }
@@ -22,6 +22,12 @@ public:
         map.try_emplace(key, std::forward<Args>(args)...);
     }
 
+    void erase(const Key &key) {
+        std::unique_lock lock(mutex);
+        if (map.erase(key) == 0)
+            throw Internal("key not found");
+    }
+
     bool contain(const Key &key) {
         std::shared_lock lock(mutex);
         return map.find(key) != map.end();
@@ -3,9 +3,12 @@
 #include <core/arena.h>
 #include <core/console.h>
 #include <core/container.h>
+#include <core/fpsimd.h>
+#include <core/futex.h>
 #include <core/physical_memory.h>
 #include <core/proc.h>
 #include <core/sched.h>
+#include <core/timer.h>
 #include <core/trap.h>
 #include <core/virtual_memory.h>
 #include <driver/clock.h>
@@ -25,6 +28,9 @@ void init_system_once() {
     init_char_device();
     init_console();
     init_sched();
+    init_proc();
+    init_futex();
+    init_fpsimd();
 
     init_memory_manager();
     init_virtual_memory();
@@ -36,15 +42,11 @@ void init_system_once() {
     release_spinlock(&init_lock);
 }
 
-void hello() {
-    // printf("CPU %d: HELLO!\n", cpuid());
-    reset_clock(1000);
-    yield();
-}
-
 void init_system_per_cpu() {
     init_clock();
-    set_clock_handler(hello);
+    set_clock_handler(timer_interrupt);
+    init_timer_cpu();
+    init_ipi();
     init_trap();
 
     // arch_enable_trap();
@@ -80,9 +82,6 @@ NO_RETURN void main() {
 
     if (cpuid() == 0) {
         spawn_init_process();
-        for (int i = 0; i < 5; i++) {
-            idle_init();
-        }
         // container_test_init();
         enter_scheduler();
     } else {